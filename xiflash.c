@@ -22,92 +22,434 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <io.h>
-#include <conio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#ifdef XIFLASH_SIM
+#include "xisim.h"
+#else
+#include <io.h>
+#include <conio.h>
 #include <malloc.h>
 #include <dos.h>
 
+/* flash ROM bus cycles, the simulator build (make sim) runs them against the flash ROM model */
+#define flash_read(address)		(*(address))
+#define flash_write(address, data)	(*(address) = (data))
+#endif
+
 #define VERSION			"0.5"
 #define DEFAULT_ROM_SIZE	32768
 
+/* use inline assembly kernels for the time critical loops, build with -DNO_ASM for C versions */
+#if defined(__WATCOMC__) && !defined(NO_ASM)
+#define USE_ASM
+#endif
+
 #define MODE_READ		1
 #define MODE_PROG		(1 << 1)
 #define MODE_VERIFY		(1 << 2)
 #define MODE_CHECKSUM		(1 << 3)
+#define MODE_MAP		(1 << 4)
+#define MODE_ERASE		(1 << 5)
+#define MODE_BLANK		(1 << 6)
+#define MODE_COMPRESS		(1 << 7)
+
+#define OPT_FULL_PROG		1			/* program all pages, even if they match the image */
+#define OPT_CHIP_ERASE		(1 << 1)		/* use chip erase instead of page erase */
+#define OPT_VERIFY		(1 << 2)		/* verify each page after programming it */
+#define OPT_STREAM		(1 << 3)		/* read the image from the file page by page */
+#define OPT_BENCH		(1 << 4)		/* measure and report the time spent in each operation */
+#define OPT_EXT			(1 << 5)		/* keep the image and the flash ROM backup in XMS or EMS */
+
+#define DEFAULT_RETRIES		3
+#define STREAM_CHUNK		4096	/* verify and checksum chunk size for streamed images */
+#define VERIFY_BLOCK		4096	/* differences are counted per block if the flash ROM type is not known */
+#define PROGRESS_TICKS		MS_TO_TICKS(250)	/* progress status update interval */
+#define MAX_REGIONS		16	/* maximal number of regions in the layout manifest */
+#define DOS_CHUNK		0xFFF0	/* largest paragraph aligned size of a single DOS read or write */
 
 
 #define TICKS_PER_SEC 1193182					/* 8254 PIT ticks per second */
-#define IDENTIFY_DELAY (TICKS_PER_SEC/100)			/* flash ID delay is 1/100 = 10 ms */
-#define WRITE_DELAY (TICKS_PER_SEC/20000)			/* write/erase delay is 1/20000 = 50 us */
-#define ERASE_TIMEOUT (TICKS_PER_SEC/10/WRITE_DELAY)		/* page erase timeout is 1/10 = 100 ms */
-#define PAGE_WRITE_TIMEOUT (TICKS_PER_SEC/10/WRITE_DELAY)	/* page write timeout is 1/10 = 100 ms */
-#define BYTE_WRITE_TIMEOUT (TICKS_PER_SEC/100/WRITE_DELAY)	/* byte write timeout is 1/100 = 10 ms */
+#define US_TO_TICKS(us) ((unsigned long) (us) * (TICKS_PER_SEC/1000) / 1000)
+#define MS_TO_TICKS(ms) ((unsigned long) (ms) * (TICKS_PER_SEC/1000))
+#define BIOS_TICKS_PER_DAY	0x1800B0L			/* BIOS timer tick count wraps at midnight */
 
-#define NUM_DEVICES 5
+/* rom_poll() return codes */
+#define POLL_DONE		0
+#define POLL_TIMEOUT		1	/* operation didn't complete in time */
+#define POLL_FAILED		2	/* device reported a failure, or data doesn't match */
+#define POLL_MISMATCH		3	/* page content doesn't match the image after programming */
+#define POLL_READ		4	/* the image data couldn't be read, read_error tells why */
+
+/* XLZ1 compressed image format */
+#define LZ_MAGIC		"XLZ1"
+#define LZ_HEADER_SIZE		8			/* magic and the image size */
+#define LZ_BLOCK		4096			/* image bytes per independently compressed block */
+#define LZ_MAX_BLOCK		(LZ_BLOCK + LZ_BLOCK / 8)	/* compressed block size if all bytes are literals */
+#define LZ_MIN_MATCH		3
+#define LZ_MAX_MATCH		(LZ_MIN_MATCH + 15)
+#define LZ_MAX_IMAGE		0x100000L		/* real mode address space */
+#define LZ_HASH_SIZE		1024
+#define LZ_HASH(data, pos)	((((data)[pos] << 5) ^ ((data)[(pos) + 1] << 2) ^ (data)[(pos) + 2]) & (LZ_HASH_SIZE - 1))
+
+/* XMS or EMS memory used by OPT_EXT */
+#define EXT_NONE		0
+#define EXT_XMS			1
+#define EXT_EMS			2
+#define EMS_PAGE		16384	/* EMS logical page size */
+#define MAX_EXT_HANDLES		4	/* the image and the backup, manifest is loaded instead of the image */
+
+/* serial port input, 8250/16550 UART registers and XMODEM-CRC protocol */
+#define UART_DATA		0
+#define UART_IER		1
+#define UART_FCR		2
+#define UART_LCR		3
+#define UART_MCR		4
+#define UART_LSR		5
+#define SERIAL_SPIN		256	/* UART status polls before starting the timeout */
+#define XMODEM_SOH		0x01	/* 128 byte block */
+#define XMODEM_STX		0x02	/* 1024 byte block */
+#define XMODEM_EOT		0x04
+#define XMODEM_ACK		0x06
+#define XMODEM_NAK		0x15
+#define XMODEM_CAN		0x18
+#define XMODEM_PAD		0x1A	/* the last block is padded with this byte */
+#define XMODEM_CRC		'C'	/* requests the transfer in CRC mode */
+#define XMODEM_RETRIES		10
+#define XMODEM_START_TRIES	20	/* 3 seconds each */
+
+/* benchmark phases */
+#define BENCH_IDENTIFY		0
+#define BENCH_FILE_READ		1
+#define BENCH_FILE_WRITE	2
+#define BENCH_CHIP_ERASE	3
+#define BENCH_ERASE		4	/* includes reading the next page ahead in low memory mode */
+#define BENCH_PROGRAM		5
+#define BENCH_VERIFY		6
+#define NUM_BENCH		7
+
+/* digests selected with -c options */
+#define DIGEST_SUM		1	/* 16-bit additive checksum */
+#define DIGEST_CRC32		(1 << 1)
+#define DIGEST_SHA1		(1 << 2)
+
+/* device capabilities */
+#define CAP_DQ5			1	/* DQ5 indicates that the operation exceeded timing limits */
+#define CAP_BYPASS		(1 << 1)	/* supports unlock bypass (two cycle) byte program */
+#define CAP_SDP			(1 << 2)	/* software data protection can be disabled */
+
+#define NUM_DEVICES 5		/* built-in devices */
+#define MAX_DEVICES		16	/* built-in and loaded from the device file with -T option */
+#define MAX_SECTOR_RUNS		8	/* runs of equal size sectors in a non-uniform sector map */
+#define MAX_CHIPS		4	/* flash ROM chips programmed or verified together with -m option */
 
 struct{
 	unsigned char vendor_id;
 	unsigned char device_id;
 	char *vendor_name;
 	char *device_name;
-	unsigned int page_size;
+	unsigned long size;		/* device size, bytes */
+	unsigned int page_size;		/* largest page (sector) size, bytes */
 	unsigned int need_erase;	/* 1 = needs erase before write */
 	unsigned int page_write;	/* 0 = byte write operation is required (page write not supported) */
-} eeproms[NUM_DEVICES] = {
-	{0x01, 0x20, "AMD",		"Am29F010",			16384,	1, 0},
-	{0x1F, 0xD5, "Atmel",		"AT29C010",			128,	0, 1},
-	{0xDA, 0xC1, "Winbond",		"W29EE011",			128,	0, 1},
-	{0xBF, 0x07, "SST/Greenliant",	"SST29EE010/GLS29EE010",	128,	0, 1},
-	{0xBF, 0xB5, "SST/Microchip",	"SST39SF010",			4096,	1, 0}
+	unsigned int caps;		/* device capabilities, CAP_* */
+	/* datasheet timings, typical and maximum; 0 = operation is not used for this device */
+	unsigned int byte_prog_typ, byte_prog_max;		/* byte program time, us */
+	unsigned int page_write_typ, page_write_max;		/* page write time, us */
+	unsigned int sector_erase_typ, sector_erase_max;	/* sector (page) erase time, ms */
+	unsigned int chip_erase_typ, chip_erase_max;		/* chip erase time, ms */
+	unsigned int id_delay;					/* software ID mode entry/exit delay, us */
+	/* non-uniform sector map from the start of the device; no runs = uniform page_size pages */
+	struct {
+		unsigned int count, size;
+	} sectors[MAX_SECTOR_RUNS];
+} eeproms[MAX_DEVICES] = {
+	{0x01, 0x20, "AMD",		"Am29F010",			131072,	16384,	1, 0, CAP_DQ5 | CAP_BYPASS,
+	 14, 1000,	0, 0,		1000, 15000,	8000, 64000,	10,	{{0, 0}}},
+	{0x1F, 0xD5, "Atmel",		"AT29C010",			131072,	128,	0, 1, CAP_SDP,
+	 0, 0,		5000, 10000,	0, 0,		10, 20,		10000,	{{0, 0}}},
+	{0xDA, 0xC1, "Winbond",		"W29EE011",			131072,	128,	0, 1, 0,
+	 0, 0,		5000, 10000,	0, 0,		25, 50,		10000,	{{0, 0}}},
+	{0xBF, 0x07, "SST/Greenliant",	"SST29EE010/GLS29EE010",	131072,	128,	0, 1, CAP_SDP,
+	 0, 0,		5000, 10000,	0, 0,		10, 20,		10,	{{0, 0}}},
+	{0xBF, 0xB5, "SST/Microchip",	"SST39SF010",			131072,	4096,	1, 0, 0,
+	 14, 20,	0, 0,		18, 25,		70, 100,	1,	{{0, 0}}}
+};
+unsigned int num_devices = NUM_DEVICES;
+
+/* block of XMS or EMS memory */
+struct ext_mem {
+	unsigned int handle;
+	unsigned long size;
+};
+
+/* flash ROM page saved by backup_page() */
+struct saved_page {
+	__segment seg;
+	unsigned int size;
+	unsigned long pos;		/* position of the content in the journal file or XMS/EMS memory */
+	unsigned int chip;		/* index of the chip in chips[] */
+};
+
+/* flash ROM image, either loaded into memory, or streamed from the file page by page */
+struct image {
+	char *name;
+	int handle;		/* DOS handle of the image file if it is streamed, -1 if it is in memory */
+	__segment seg;		/* image data if in memory, stream buffer otherwise */
+	void __huge *buf;	/* memory allocated for the image data or the stream buffer */
+	__segment next_seg;	/* stream buffer for the data read ahead by image_prefetch() */
+	void __huge *next_buf;
+	unsigned int ahead;	/* next_seg contains the data for the next image_next() call */
+	unsigned int buf_size;	/* stream buffers size */
+	unsigned long size;	/* image size */
+	unsigned long pos;	/* position of the data returned by the next image_next() call */
+	unsigned int compressed;	/* the file is in XLZ1 format */
+	__segment lz_in_seg;		/* compressed block buffer */
+	void __huge *lz_in_buf;
+	__segment lz_block_seg;		/* decoded block buffer for streamed compressed images */
+	void __huge *lz_block_buf;
+	unsigned int lz_block_pos, lz_block_size;	/* bytes used and decoded in the block buffer */
+	unsigned long lz_decoded;	/* image bytes decoded so far */
+	unsigned int extended;		/* the image is loaded into XMS or EMS memory and streamed from it */
+	struct ext_mem ext;
+	unsigned long ext_pos;		/* position of the data returned by the next image_read() call */
+	unsigned int serial;		/* the image is received from the serial port, can be read once */
+};
+
+/* state of the digests computed in a single pass over the data */
+struct sha1 {
+	unsigned long h[5];
+	unsigned long length;		/* message length, bytes */
+	unsigned char block[64];	/* partial block */
+	unsigned int fill;
+};
+
+struct digest {
+	unsigned short sum;
+	unsigned long crc32;
+	struct sha1 sha1;
+};
+
+/* flash ROM region listed in the layout manifest */
+struct region {
+	__segment seg;
+	unsigned long size;
+	char name[80];
+};
+
+/* image of the manifest regions in one flash ROM chip */
+struct target {
+	struct image image;
+	__segment seg;			/* first segment of the image */
+	unsigned int chip;		/* index of the chip in chips[] */
+	/* programming state of rom_program_chips() */
+	__segment page_seg, file_seg, merge_seg;
+	void __huge *merge_buf;
+	unsigned int head, page, num_pages, page_size, first_page, erase;
+	unsigned long start;
 };
 
 char *exec_name;
 
 unsigned int cmd_addr1 = 0x5555, cmd_addr2 = 0x2AAA;
+unsigned char id_cmd = 0x90;	/* software ID mode entry command that worked: 0x90 or 0x60 */
+
+/* flash ROM identity, saved to the cache file specified with -k option, or set with -t option */
+struct {
+	unsigned int vendor_id, device_id;
+	unsigned int rom_start;
+	unsigned int cmd_addr1, cmd_addr2;
+	unsigned int id_cmd;
+} id_cache;
+char *id_cache_file = NULL;
+unsigned int id_override = 0;	/* -t option specified, don't probe the device */
+
+unsigned int options = 0;
+unsigned int retries = DEFAULT_RETRIES;
+unsigned int digests = 0;
+unsigned int max_diffs = 0;	/* stop verifying after this number of difference ranges, 0 = no limit */
+
+unsigned long crc32_table[256];
+unsigned int crc16_table[256];
+unsigned int lz_head[LZ_HASH_SIZE];	/* last position of each hash in the block being compressed */
+
+unsigned int timer_loop = 0;	/* PIT can't be read back, pit_ticks() counts its calls */
+char *timer_mode = "PIT channel 2 count";	/* timer source chosen by timer_init() */
+unsigned long pit_loop_ticks;	/* calibrated PIT ticks per pit_ticks() call in the loop mode */
+unsigned int pit_last;		/* PIT channel 2 count at the last pit_ticks() call */
+unsigned int pit_bios_ticks;	/* BIOS timer tick count at the last pit_ticks() call */
+unsigned long pit_elapsed;	/* PIT ticks since timer_init() */
+unsigned long pit_deadline;	/* pit_ticks() value when the countdown started by pit_start() is over */
+
+unsigned int irq_scoped = 0;	/* nothing runs from the chip, mask the interrupts only around commands */
+unsigned long hold_start;	/* pit_ticks() value when interrupts_hold() masked the interrupts */
+unsigned long hold_lost;	/* PIT ticks missed by the BIOS timer, not added to its count yet */
+
+/* benchmark statistics, times in PIT ticks */
+struct {
+	char *name;
+	unsigned long count;
+	unsigned long bytes;
+	unsigned long total, min, max;
+} benchmarks[NUM_BENCH] = {
+	{"Identify", 0, 0, 0, 0, 0},	{"File read", 0, 0, 0, 0, 0},	{"File write", 0, 0, 0, 0, 0},
+	{"Chip erase", 0, 0, 0, 0, 0},	{"Page erase", 0, 0, 0, 0, 0},	{"Page program", 0, 0, 0, 0, 0},
+	{"Verify", 0, 0, 0, 0, 0}
+};
+
+/* flash ROM chips identified by rom_detect() */
+struct chip {
+	__segment window;		/* segment the chip was identified for, E000 for the system ROM BIOS area */
+	__segment rom_start;
+	unsigned int eeprom_index;
+	unsigned int cmd_addr1, cmd_addr2;
+	unsigned int sdp_disabled;	/* software data protection is disabled by rom_sdp_disable() */
+	__segment sdp_page;		/* the last page written while it is disabled, and its size */
+	unsigned int sdp_page_size;
+} chips[MAX_CHIPS];
+unsigned int num_chips = 0;
+unsigned int chip_current;	/* chip selected by chip_select(), its command addresses are in use */
+
+/* progress display, the bar and the status are in the text mode video memory */
+unsigned char __far *progress_bar = 0;		/* 0 if not in a text mode */
+unsigned char __far *progress_status = 0;
+unsigned int progress_status_size;		/* status text space, characters */
+unsigned int progress_teletype;			/* show the status using BIOS teletype output */
+unsigned int progress_pages_per_column;
+unsigned long progress_total, progress_start, progress_last;
+
+unsigned int blank_skipped = 0;	/* number of page erases skipped, because the page was blank */
+
+__segment sdp_seg = 0;		/* rom_sdp_enable() writes the pages again through this buffer */
+void __huge *sdp_buf;
+unsigned int rom_modified = 0;	/* a page or the chip has been erased or programmed */
+
+unsigned int bypass_failed = 0;	/* device didn't program in unlock bypass mode, don't use it */
+
+unsigned int ext_kind = EXT_NONE;	/* XMS or EMS memory driver found by ext_init() */
+char *ext_names[] = {"conventional", "XMS", "EMS"};
+void __far *xms_entry;			/* XMS driver entry point */
+__segment ems_frame;			/* EMS page frame segment */
+unsigned int ext_handles[MAX_EXT_HANDLES], num_ext_handles = 0;	/* blocks to free at exit */
+unsigned int ext_word;			/* buffer for the odd bytes of XMS moves */
+
+/* XMS move structure, handle 0 means that the offset is a real mode seg:offset address */
+struct {
+	unsigned long length;
+	unsigned int src_handle;
+	unsigned long src_offset;
+	unsigned int dst_handle;
+	unsigned long dst_offset;
+} xms_block;
+
+/* original content of the flash ROM pages saved by backup_page(), restored by rom_restore() */
+char *journal_file = NULL;		/* save the pages to this file instead of XMS or EMS memory */
+int backup_handle = -1;			/* journal file handle */
+struct ext_mem backup;
+struct saved_page *backup_list = NULL;	/* saved pages, NULL if there is no backup */
+unsigned int backup_pages = 0;		/* number of saved pages */
+unsigned long backup_size;		/* total size of the saved pages */
+__segment backup_buf_seg;		/* page buffer for restoring the backup */
+__segment backup_seg = 0;		/* pages saved in conventional memory, 0 if not used */
+void __huge *backup_mem;
+
+/* XMODEM-CRC receiver state */
+unsigned int serial_port;		/* UART I/O base address */
+unsigned char xmodem_buf[1024];
+unsigned int xmodem_pos, xmodem_size;	/* bytes used and received in xmodem_buf */
+unsigned char xmodem_block;		/* number of the next block */
+unsigned char xmodem_response;		/* sent to the sender to get the next block */
+
+char read_error[100];			/* why image_fetch() couldn't read the image */
 
 void interrupts_disable()
 {
-	__asm {
-		cli
-		push	ax
-		mov	al,0
-		out	0xA0,al
-		pop	ax
-	}
+	_disable();
+	outp(0xA0, 0);
 }
 
 void interrupts_enable()
 {
-	__asm {
-		push	ax
-		mov	al,0x80
-		out	0xA0,al
-		pop	ax
-		sti
-	}
+	outp(0xA0, 0x80);
+	_enable();
 }
 
 void usage()
 {
-	printf("Usage: %s [-r|-p|-v|-c] [-i <input_file>] [-o <output_file>] [-a <address>] [-s <size>]\n\n", exec_name);
+	printf("Usage: %s [-r|-p|-v|-c [sum|crc32|sha1]|-H|-e|-B|-z] [-i <input_file>|-m <manifest>|-S <port>] [-o <output_file>] [-a <address>] [-s <size>] [-f] [-C] [-n <retries>] [-l] [-x] [-j <journal_file>] [-b] [-k <cache_file>] [-t <vendor_id>:<device_id>] [-T <device_file>] [--first-diff|--max-diffs <n>]\n\n", exec_name);
 	printf("Options:\n");
 	printf("   -r   - Read mode. Save current flash ROM content into <output_file>.\n");
 	printf("   -p   - Program mode. Program flash ROM with <input_file> data.\n");
+	printf("          Only the pages that differ from <input_file> are programmed.\n");
 	printf("   -v   - Verify mode. Compare current flash ROM content with <input_file>.\n");
+	printf("          Combined with -p, each page is verified right after programming it.\n");
+	printf("          Consecutive differences are reported as ranges, and counted per page.\n");
+	printf("          Exits with code 13 if there are differences.\n");
 	printf("   -c   - Print a checksum. If <input_file> specified, its checksum will\n");
 	printf("          be printed. Otherwise the current flash ROM checksum is printed.\n");
-	printf("   -i   - Specifies input file for -p, -v, and, -c options.\n");
-	printf("   -o   - Specifies output file for -r option.\n");
+	printf("          The checksum type is sum (16-bit additive checksum, the default),\n");
+	printf("          crc32, or sha1. Repeat -c to compute several types in one pass.\n");
+	printf("   -H   - Print a sector map: CRC-32 of each flash ROM page. If <input_file>\n");
+	printf("          specified, the map of the file is printed. Otherwise the map of the\n");
+	printf("          current flash ROM content is printed. Saved to <output_file> if set.\n");
+	printf("   -e   - Erase mode. Erase the flash ROM area specified by -a and -s options.\n");
+	printf("          The pages that are blank already are not erased. Combined with -C,\n");
+	printf("          the entire flash ROM is erased.\n");
+	printf("   -B   - Blank check mode. Report the blank (erased) and non-blank pages in the\n");
+	printf("          flash ROM area specified by -a and -s options.\n");
+	printf("   -z   - Compress mode. Save <input_file> to <output_file> in compressed format.\n");
+	printf("          Compressed files can be used as <input_file> with the other options.\n");
+	printf("   -i   - Specifies input file for -p, -v, -c, -H, and -z options.\n");
+	printf("   -m   - Program or verify several regions listed in <manifest> in one pass,\n");
+	printf("          instead of -i. Each line of <manifest> specifies the region's\n");
+	printf("          segment address in hexadecimal format followed by the file name.\n");
+	printf("          The regions can be in several flash ROM chips, for example an option\n");
+	printf("          ROM flash and the system BIOS flash. The chips are programmed together.\n");
+	printf("   -S   - Receive the image with XMODEM-CRC from the serial port, instead of -i.\n");
+	printf("          <port> is COM1 - COM4, optionally followed by the baud rate, for\n");
+	printf("          example COM1:115200 (the default rate). The image is programmed as it\n");
+	printf("          is received. Its size is specified with -s option.\n");
+	printf("   -o   - Specifies output file for -r, -H, and -z options.\n");
 	printf("   -a   - Segment address of flash ROM area to work on in hexadecimal format.\n");
 	printf("          Must be in C000-FFFF range. The default is FA00 (Micro 8088 BIOS\n");
 	printf("          address) for 24 KiB images, F800 (BIOS address) for 32 KiB images,\n");
 	printf("          F000 for 64 KiB images, and E000 for 128 KiB images.\n");
-	printf("   -s   - Specifies ROM size for -r and -c options.\n");
-	printf("	  The default is %u.\n\n", DEFAULT_ROM_SIZE);
+	printf("   -s   - Specifies ROM size for -r, -c, -H, -e, and -B options, and the size\n");
+	printf("          of the image received with -S option.\n");
+	printf("	  The default is %u.\n", DEFAULT_ROM_SIZE);
+	printf("   -f   - Full programming. Erase and program all pages for -p option,\n");
+	printf("          including the pages that already match <input_file>.\n");
+	printf("   -C   - Use chip erase for -p option. Erases the entire flash ROM, including\n");
+	printf("          the areas outside of <input_file>. Chip erase is used automatically\n");
+	printf("          when <input_file> covers the entire flash ROM, and it is faster.\n");
+	printf("   -n   - Number of times to retry erasing and programming a page that failed\n");
+	printf("          to program or verify. The default is %u.\n", DEFAULT_RETRIES);
+	printf("   -l   - Low memory mode. Read <input_file> page by page while programming\n");
+	printf("          or verifying, instead of loading it to memory. This is done\n");
+	printf("          automatically if there is not enough memory to load the file.\n");
+	printf("   -x   - Use XMS or EMS memory. Load <input_file> or the regions listed in\n");
+	printf("          <manifest> to XMS or EMS memory if they don't fit in conventional\n");
+	printf("          memory or with -l, and save the flash ROM pages that will change to\n");
+	printf("          it before programming them. If a page fails to program, the original\n");
+	printf("          content is restored.\n");
+	printf("   -j   - Save the flash ROM pages that will change to <journal_file> instead\n");
+	printf("          of XMS or EMS memory. The file is deleted after programming.\n");
+	printf("          With -x or -j, the pages of a chip that the system runs code from\n");
+	printf("          are saved to conventional memory.\n");
+	printf("   -k   - Save the detected flash ROM type and its command addresses to\n");
+	printf("          <cache_file>. If the file exists, check the saved type with a single\n");
+	printf("          ID read instead of probing the flash ROM.\n");
+	printf("   -t   - Don't probe the flash ROM, use the specified vendor and device IDs in\n");
+	printf("          hexadecimal format, for example -t BF:B5 for SST39SF010.\n");
+	printf("   -T   - Load flash ROM types from <device_file>, in addition to the built-in\n");
+	printf("          types. Each line specifies vendor and device IDs, vendor and device\n");
+	printf("          names, size, sector map, flags, timings, and ID mode delay.\n");
+	printf("   --first-diff - Stop -v option at the first range of differences.\n");
+	printf("   --max-diffs  - Stop -v option after <n> ranges of differences.\n");
+	printf("   -b   - Benchmark. Measure the time spent identifying, erasing, programming\n");
+	printf("          and verifying the flash ROM, and reading and writing files.\n\n");
 	exit(1);
 }
 
@@ -117,35 +459,386 @@ void error(char *message)
 	usage();
 }
 
+/* pit_read - latch and read the current count of 8254 PIT channel 2 */
+unsigned int pit_read()
+{
+	unsigned int count;
+
+	outp(0x43, 0x80);		/* latch PIT channel 2 count */
+	count = inp(0x42);		/* read the latched count - low byte */
+	count |= inp(0x42) << 8;	/* read the latched count - high byte */
+	return count;
+}
+
+/*
+ * pit_ticks - return the number of PIT ticks since timer_init()
+ * The counter wraps around every 65536 ticks (55 ms), so it must be called more
+ * often than that. When interrupts are enabled, the missed wrap arounds are
+ * added based on the BIOS timer tick count.
+ */
+unsigned long pit_ticks()
+{
+	volatile unsigned short __far *bios_ticks = MK_FP(0x0040, 0x006C);
+	unsigned int count, bios_now, bios_elapsed;
+	unsigned long ticks;
+
+	if (timer_loop) {
+		pit_elapsed += pit_loop_ticks;
+		return pit_elapsed;
+	}
+
+	count = pit_read();
+	ticks = (pit_last - count) & 0xFFFF;
+	pit_last = count;
+	bios_now = *bios_ticks;
+	bios_elapsed = (bios_now - pit_bios_ticks) & 0xFFFF;
+	pit_bios_ticks = bios_now;
+	/* at least 65536 * (bios_elapsed - 1) ticks have passed */
+	if (bios_elapsed > 1 && ticks < ((unsigned long) (bios_elapsed - 1) << 16))
+		ticks += (((unsigned long) (bios_elapsed - 1) << 16) - ticks + 0xFFFF) & 0xFFFF0000;
+	pit_elapsed += ticks;
+	return pit_elapsed;
+}
+
+/*
+ * timer_init - set up 8254 PIT channel 2 as a free running counter for delays and timeouts
+ * If the channel 2 gate can't be enabled, or the counter doesn't change for two BIOS
+ * timer ticks, fall back to counting pit_ticks() calls, calibrated against the BIOS
+ * timer ticks. timer_mode tells which one is used. Must be called with interrupts enabled.
+ */
+void timer_init()
+{
+	volatile unsigned short __far *bios_ticks = MK_FP(0x0040, 0x006C);
+	unsigned int tick;
+	unsigned long calls;
+
+	outp(0x61, inp(0x61) | 0x01);	/* enable 8254 PIT channel 2, 8255 PPI port B */
+	outp(0x43, 0xB4);		/* set PIT channel 2 to mode 2 */
+	outp(0x42, 0);			/* initial count 0 (65536) - low byte */
+	outp(0x42, 0);			/* initial count 0 (65536) - high byte */
+
+	pit_last = pit_read();
+	pit_bios_ticks = *bios_ticks;
+	if (!(inp(0x61) & 0x01)) {
+		timer_mode = "pit_ticks() call count, PIT channel 2 gate can't be enabled";
+	} else {
+		/* the count changes every 838 ns, a stalled counter shows up after a BIOS tick or two */
+		tick = *bios_ticks;
+		while (((*bios_ticks - tick) & 0xFFFF) < 2)
+			if (pit_read() != pit_last)
+				return;
+		timer_mode = "pit_ticks() call count, PIT channel 2 count doesn't change";
+	}
+
+	/*
+	 * the counter can't be used, count the calls during one BIOS timer tick;
+	 * the loops that wait with the timer read a port each time, and so does this one
+	 */
+	timer_loop = 1;
+	pit_loop_ticks = 0;
+	tick = *bios_ticks;
+	while (*bios_ticks == tick)
+		inp(0x61);
+	tick = *bios_ticks;
+	for (calls = 0; *bios_ticks == tick; calls++) {
+		pit_ticks();
+		inp(0x61);
+	}
+	if (calls == 0)
+		calls = 1;
+	pit_loop_ticks = (calls < 65536) ? 65536 / calls : 1;
+	pit_elapsed = 0;
+}
+
+/* pit_start - start a countdown of ticks PIT ticks, use pit_expired() to check if it is over */
+void pit_start(unsigned long ticks)
+{
+	pit_deadline = pit_ticks() + ticks;
+}
+
+/* pit_expired - return non-zero if the countdown started by pit_start() is over */
+unsigned char pit_expired()
+{
+	return (long) (pit_ticks() - pit_deadline) >= 0;
+}
+
 void pit_delay(unsigned int ticks)
 {
+	pit_start(ticks);
+	while (!pit_expired())
+		;
+}
+
+/*
+ * interrupts_hold - mask the interrupts for a flash ROM update
+ * If the system might run code from the chip, the interrupts stay masked while it is busy.
+ * Otherwise (irq_scoped) only the command sequences are masked with command_begin().
+ */
+void interrupts_hold()
+{
+	if (irq_scoped)
+		return;
+	interrupts_disable();
+	hold_start = pit_ticks();
+}
+
+/*
+ * interrupts_release - unmask the interrupts masked by interrupts_hold()
+ * The BIOS timer ticks missed while the interrupts were masked are added to the BIOS
+ * tick count, so the DOS clock doesn't fall behind. The PIC keeps one of them pending.
+ */
+void interrupts_release()
+{
+	volatile unsigned short __far *bios_ticks = MK_FP(0x0040, 0x006C);
+	volatile unsigned char __far *bios_midnight = MK_FP(0x0040, 0x0070);
+	unsigned long elapsed, count;
+
+	if (irq_scoped)
+		return;
+	elapsed = pit_ticks() - hold_start;
+	if (elapsed > 0x10000)
+		hold_lost += elapsed - 0x10000;
+	if (hold_lost >= 0x10000) {
+		count = (bios_ticks[0] | ((unsigned long) bios_ticks[1] << 16)) + (hold_lost >> 16);
+		hold_lost &= 0xFFFF;
+		if (count >= BIOS_TICKS_PER_DAY) {
+			count -= BIOS_TICKS_PER_DAY;
+			*bios_midnight = 1;
+		}
+		bios_ticks[0] = count;
+		bios_ticks[1] = count >> 16;
+		pit_bios_ticks = count;		/* these ticks have been counted by pit_ticks() already */
+	}
+	interrupts_enable();
+}
+
+/* command_begin - mask the interrupts for a command sequence or a page load, unless held already */
+void command_begin()
+{
+	if (irq_scoped)
+		interrupts_disable();
+}
+
+void command_end()
+{
+	if (irq_scoped)
+		interrupts_enable();
+}
+
+/* bench_start - return the benchmark stopwatch value for bench_stop() */
+unsigned long bench_start()
+{
+	if (!(options & OPT_BENCH))
+		return 0;
+	return pit_ticks();
+}
+
+/* bench_stop - add the time since bench_start() to the statistics of the benchmark phase */
+void bench_stop(unsigned int phase, unsigned long start, unsigned long bytes)
+{
+	unsigned long ticks;
+
+	if (!(options & OPT_BENCH))
+		return;
+	ticks = pit_ticks() - start;
+	if (benchmarks[phase].count == 0 || ticks < benchmarks[phase].min)
+		benchmarks[phase].min = ticks;
+	if (ticks > benchmarks[phase].max)
+		benchmarks[phase].max = ticks;
+	benchmarks[phase].total += ticks;
+	benchmarks[phase].bytes += bytes;
+	benchmarks[phase].count++;
+}
+
+/* ticks_to_us - convert PIT ticks to microseconds */
+unsigned long ticks_to_us(unsigned long ticks)
+{
+	return ticks / (TICKS_PER_SEC/1000) * 1000 + ticks % (TICKS_PER_SEC/1000) * 1000 / (TICKS_PER_SEC/1000);
+}
+
+/* bench_report - print the benchmark statistics */
+void bench_report(unsigned long start)
+{
+	unsigned int phase;
+	unsigned long total, min, avg, max;
+
+	printf("\nBenchmark results (timer: %s):\n", timer_mode);
+	printf("Operation     Count     Total, ms       Min, ms       Avg, ms       Max, ms   Bytes/s\n");
+	for (phase = 0; phase < NUM_BENCH; phase++) {
+		if (benchmarks[phase].count == 0)
+			continue;
+		total = ticks_to_us(benchmarks[phase].total);
+		min = ticks_to_us(benchmarks[phase].min);
+		avg = ticks_to_us(benchmarks[phase].total / benchmarks[phase].count);
+		max = ticks_to_us(benchmarks[phase].max);
+		printf("%-12s %6lu %9lu.%03lu %9lu.%03lu %9lu.%03lu %9lu.%03lu", benchmarks[phase].name,
+		       benchmarks[phase].count, total / 1000, total % 1000, min / 1000, min % 1000,
+		       avg / 1000, avg % 1000, max / 1000, max % 1000);
+		if (benchmarks[phase].bytes != 0 && total >= 100)
+			printf(" %9lu\n", benchmarks[phase].bytes * 10000 / (total / 100));
+		else
+			printf("         -\n");
+	}
+	total = ticks_to_us(bench_start() - start);
+	printf("Total time: %lu.%03lu ms\n", total / 1000, total % 1000);
+}
+
+/*
+ * mem_match - compare count bytes at seg1:start and seg2:start
+ * Returns the number of matching bytes before the first difference, count if all match.
+ * start + count must not exceed 64 KiB.
+ */
+unsigned int mem_match(__segment seg1, __segment seg2, unsigned int start, unsigned int count)
+{
+	unsigned int matched;
+#ifdef USE_ASM
 	__asm {
+		push	ds
+		push	es
+		push	si
+		push	di
+		push	cx
 		push	ax
-		push	bx
-		in	al,0x61
-		or	al,0x01			/* enable 8254 PIT channel 2 */
-		out	0x61,al			/* write to 8255 PPI port B */
-		mov	bl,al			/* save written value for XT/AT test */
-		mov	al,0xB0			/* set PIT channel 2 to mode 0 */
-		out	0x43,al			/* write control word to PIT */
-		mov	ax,ticks
-		out	0x42,al			/* set PIT channel 2 inital count - low byte */
-		mov	al,ah
-		out	0x42,al			/* set PIT channel 2 inital count - high byte */
-	delay_loop:
-		in	al,0x61			/* try reading port B first */
-		cmp	al,bl
-		jne	delay_test		/* port B value had changed, must be Xi 8088 (or an AT) */
-		in	al,0x62			/* read PPI port C */
-	delay_test:
-		test	al,0x20			/* check if bit 5 set - PIT channel 2 output */
-		jz	delay_loop		/* not set, keep waiting */
-		pop	bx
+		mov	cx,count
+		mov	si,start
+		mov	di,si
+		mov	ax,seg2
+		mov	es,ax
+		mov	ax,seg1
+		mov	ds,ax
+		cld
+		shr	cx,1			/* compare words first */
+		repe	cmpsw
+		je	match_words_equal
+		sub	si,2			/* mismatch - find out which byte of the word */
+		sub	di,2
+		mov	cx,2
+		jmp	match_bytes
+	match_words_equal:
+		mov	cx,count
+		and	cx,1			/* compare the last byte if count is odd */
+		jcxz	match_done
+	match_bytes:
+		repe	cmpsb
+		je	match_done
+		dec	si			/* point to the mismatching byte */
+	match_done:
+		mov	ax,si
+		sub	ax,start
+		mov	matched,ax
+		pop	ax
+		pop	cx
+		pop	di
+		pop	si
+		pop	es
+		pop	ds
+	}
+#else
+	unsigned char __far *data1 = MK_FP(seg1, start);
+	unsigned char __far *data2 = MK_FP(seg2, start);
+
+	for (matched = 0; matched < count; matched++)
+		if (data1[matched] != data2[matched])
+			break;
+#endif
+	return matched;
+}
+
+/*
+ * mem_differ - compare count bytes at seg1:start and seg2:start
+ * Returns the number of differing bytes before the first match, count if all differ.
+ * start + count must not exceed 64 KiB.
+ */
+unsigned int mem_differ(__segment seg1, __segment seg2, unsigned int start, unsigned int count)
+{
+	unsigned int differ;
+#ifdef USE_ASM
+	__asm {
+		push	ds
+		push	es
+		push	si
+		push	di
+		push	cx
+		push	ax
+		mov	cx,count
+		mov	si,start
+		mov	di,si
+		mov	ax,seg2
+		mov	es,ax
+		mov	ax,seg1
+		mov	ds,ax
+		cld
+		jcxz	differ_done
+		repne	cmpsb
+		jne	differ_done
+		dec	si			/* point to the matching byte */
+	differ_done:
+		mov	ax,si
+		sub	ax,start
+		mov	differ,ax
 		pop	ax
+		pop	cx
+		pop	di
+		pop	si
+		pop	es
+		pop	ds
 	}
+#else
+	unsigned char __far *data1 = MK_FP(seg1, start);
+	unsigned char __far *data2 = MK_FP(seg2, start);
+
+	for (differ = 0; differ < count; differ++)
+		if (data1[differ] == data2[differ])
+			break;
+#endif
+	return differ;
+}
+
+/* rom_blank - return non-zero if count bytes at data_seg:0 are all 0xFF, count must be even */
+unsigned int rom_blank(__segment data_seg, unsigned int count)
+{
+	unsigned int blank;
+#ifdef USE_ASM
+	__asm {
+		push	es
+		push	di
+		push	cx
+		push	ax
+		mov	cx,count
+		mov	ax,data_seg
+		mov	es,ax
+		xor	di,di
+		mov	ax,0xFFFF
+		mov	blank,0
+		cld
+		shr	cx,1			/* compare words */
+		jcxz	blank_yes
+		repe	scasw
+		jne	blank_done
+	blank_yes:
+		mov	blank,1
+	blank_done:
+		pop	ax
+		pop	cx
+		pop	di
+		pop	es
+	}
+#else
+	unsigned short __far *data = MK_FP(data_seg, 0);
+	unsigned int offset;
+
+	blank = 1;
+	for (offset = 0; offset < count / 2; offset++)
+		if (data[offset] != 0xFFFF) {
+			blank = 0;
+			break;
+		}
+#endif
+	return blank;
 }
 
-unsigned char __far *get_video_address()
+/* get_video_address - return the text mode video memory address at the cursor, 0 in graphics modes */
+unsigned char __far *get_video_address(unsigned int *columns_left)
 {
 	unsigned char video_mode;
 	unsigned char num_columns;
@@ -163,8 +856,9 @@ unsigned char __far *get_video_address()
 	int86(0x10, &r, &r);	/* INT 0x10 function 0x03 - Get cursor position and size */
 	column = r.h.dl;
 	row = r.h.dh;
+	*columns_left = num_columns - column;
 	if (video_mode <= 3) { /* CGA-compatible text modes */
-		video_address = 0xB800:>0;	/* Video buffer start address for the color text modes */
+		video_address = MK_FP(0xB800, 0);	/* Video buffer start address for the color text modes */
 		if (num_columns == 40) {
 			video_address += 2048 * video_page; /* add page offset for 40 column modes */
 		} else {
@@ -172,7 +866,7 @@ unsigned char __far *get_video_address()
 		}
 		video_address += (unsigned int) (num_columns * row + column) * 2;
 	} else if (video_mode == 7) { /* MDA-compatible text mode */
-		video_address = 0xB000:>0;	/* Video buffer start for the monochrome text mode */
+		video_address = MK_FP(0xB000, 0);	/* Video buffer start for the monochrome text mode */
 		video_address += (unsigned int) (num_columns * row + column) * 2;
 	}
 	return video_address;
@@ -186,378 +880,3525 @@ void video_write_char(unsigned char __far *video_address, unsigned char ch, unsi
 	}
 }
 
-void rom_verify(__segment rom_seg, __segment file_seg, unsigned long rom_size) {
-	unsigned long bytes_to_verify, verify_size, offset, diff = 0;
-	unsigned char rom_data, file_data;
+/* teletype_write - print the text using BIOS teletype output, doesn't need DOS */
+void teletype_write(char *text)
+{
+	union REGS r;
+
+	while (*text != '\0') {
+		r.h.ah = 0x0E;
+		r.h.al = *text++;
+		r.h.bh = 0;
+		r.h.bl = 0x07;
+		int86(0x10, &r, &r);	/* INT 0x10 function 0x0E - Teletype output */
+	}
+}
 
-	bytes_to_verify = rom_size;
-	while (bytes_to_verify > 0) {
-		/* verify up to 64 KiB at a time */
-		if (bytes_to_verify > 0x10000) {
-			verify_size = 0x10000;
+/*
+ * progress_init - draw an empty progress bar for num_pages pages covering total bytes
+ * In graphics modes, the status is printed with BIOS teletype output if teletype is set.
+ * It must not be set if the video BIOS is in the flash ROM being programmed.
+ */
+void progress_init(unsigned int num_pages, unsigned long total, int teletype)
+{
+	unsigned int columns_left, bar_size, page;
+
+	progress_bar = get_video_address(&columns_left);
+	progress_teletype = (progress_bar == 0) && teletype;
+	bar_size = (columns_left >= 80) ? 32 : 16;
+	progress_pages_per_column = (num_pages + bar_size - 1) / bar_size;
+	bar_size = (num_pages + progress_pages_per_column - 1) / progress_pages_per_column;
+	if (progress_bar != 0) {
+		progress_status = progress_bar + bar_size * 2;
+		progress_status_size = (columns_left > bar_size) ? columns_left - bar_size - 1 : 0;
+		for (page = 0; page < num_pages; page += progress_pages_per_column)
+			video_write_char(progress_bar + (page / progress_pages_per_column) * 2, 0xB0, 0x07);
+	}
+	progress_total = total;
+	progress_start = pit_ticks();
+	progress_last = progress_start;
+}
+
+/* progress_page - return the video memory address of the page in the progress bar, or 0 */
+unsigned char __far *progress_page(unsigned int page)
+{
+	if (progress_bar == 0)
+		return 0;
+	return progress_bar + (page / progress_pages_per_column) * 2;
+}
+
+/*
+ * progress_update - show the number of bytes done, the throughput, and the remaining time
+ * The status is updated at most every PROGRESS_TICKS, unless force is set.
+ */
+void progress_update(unsigned long done, int force)
+{
+	char text[80];
+	unsigned long now, ms, rate = 0, eta = 0;
+	unsigned int i;
+
+	if (progress_bar == 0 && !progress_teletype)
+		return;
+	now = pit_ticks();
+	if (!force && now - progress_last < PROGRESS_TICKS)
+		return;
+	progress_last = now;
+
+	ms = ticks_to_us(now - progress_start) / 1000;
+	if (ms > 0)
+		rate = done * 1000 / ms;
+	if (rate > 0)
+		eta = (progress_total - done) / rate;
+	sprintf(text, " %3u%% ETA %lu:%02lu %lu B/s %lu/%lu bytes",
+		(unsigned int) (done * 100 / progress_total), eta / 60, eta % 60, rate, done,
+		progress_total);
+
+	if (progress_bar != 0) {
+		for (i = 0; i < progress_status_size && text[i] != '\0'; i++)
+			video_write_char(progress_status + i * 2, text[i], 0x07);
+		for (; i < progress_status_size; i++)
+			video_write_char(progress_status + i * 2, ' ', 0x07);
+	} else {
+		teletype_write("\r");
+		teletype_write(text);
+	}
+}
+
+/* seg_alloc - allocate a paragraph aligned buffer, return its segment or 0 if out of memory */
+__segment seg_alloc(unsigned long size, void __huge **buf)
+{
+	if ((*buf = halloc(size + 15, 1)) == NULL)
+		return 0;
+	/* round the buffer address up to the paragraph boundary, so it starts at offset 0 */
+	return FP_SEG(*buf) + ((FP_OFF(*buf) + 15) >> 4);
+}
+
+/* xms_call - call the XMS driver function with DX and the move structure, return AX */
+unsigned int xms_call(unsigned char function, unsigned int *dx)
+{
+	unsigned int result, data = *dx;
+
+#ifdef XIFLASH_SIM
+	(void) function;
+	result = 0;	/* the simulator has no XMS driver, ext_init() doesn't find it */
+#else
+	__asm {
+		push	ax
+		push	bx
+		push	dx
+		push	si
+		mov	ah,function
+		mov	dx,data
+		lea	si,xms_block
+		call	dword ptr xms_entry
+		mov	result,ax
+		mov	data,dx
+		pop	si
+		pop	dx
+		pop	bx
+		pop	ax
+	}
+#endif
+	*dx = data;
+	return result;
+}
+
+/* ext_free_all - free all allocated XMS or EMS blocks */
+void ext_free_all()
+{
+	union REGS r;
+	unsigned int handle;
+
+	while (num_ext_handles > 0) {
+		handle = ext_handles[--num_ext_handles];
+		if (ext_kind == EXT_XMS) {
+			xms_call(0x0A, &handle);	/* XMS function 0x0A - Free extended memory block */
 		} else {
-			verify_size = bytes_to_verify;
+			r.h.ah = 0x45;
+			r.x.dx = handle;
+			int86(0x67, &r, &r);	/* INT 0x67 function 0x45 - Release pages */
 		}
-		for (offset = 0; offset < verify_size; offset++) {
-			rom_data = ((unsigned char __far *)rom_seg:>0)[offset];
-			file_data = ((unsigned char __far *)file_seg:>0)[offset];
+	}
+}
+
+/*
+ * ext_init - find the XMS or the EMS driver, return EXT_NONE if neither is installed
+ * The allocated blocks are freed at exit, DOS doesn't free them.
+ */
+unsigned int ext_init()
+{
+	union REGS r;
+	struct SREGS s;
+	unsigned short __far *ivt = MK_FP(0, 0);
+	__segment driver_seg;
+	__segment entry_seg;
+	unsigned int entry_offset;
+
+	r.x.ax = 0x4300;
+	int86(0x2F, &r, &r);	/* INT 0x2F function 0x4300 - XMS installation check */
+	if (r.h.al == 0x80) {
+		r.x.ax = 0x4310;
+		segread(&s);
+		int86x(0x2F, &r, &r, &s);	/* INT 0x2F function 0x4310 - Get XMS driver address */
+		entry_seg = s.es;
+		entry_offset = r.x.bx;
+		xms_entry = MK_FP(entry_seg, entry_offset);
+		ext_kind = EXT_XMS;
+	} else {
+		/* EMS driver device header has the device name at offset 10 */
+		driver_seg = ivt[0x67 * 2 + 1];
+		if (_fmemcmp(MK_FP(driver_seg, 10), "EMMXXXX0", 8) != 0)
+			return EXT_NONE;
+		r.h.ah = 0x40;
+		int86(0x67, &r, &r);	/* INT 0x67 function 0x40 - Get EMS status */
+		if (r.h.ah != 0)
+			return EXT_NONE;
+		r.h.ah = 0x41;
+		int86(0x67, &r, &r);	/* INT 0x67 function 0x41 - Get page frame segment */
+		if (r.h.ah != 0)
+			return EXT_NONE;
+		ems_frame = r.x.bx;
+		ext_kind = EXT_EMS;
+	}
+	atexit(ext_free_all);
+	return ext_kind;
+}
+
+/*
+ * ext_alloc - allocate size bytes of XMS or EMS memory
+ * XMS blocks are rounded up to even size, as XMS moves even number of bytes.
+ * Returns 0 on success, non-zero if there is no such memory or not enough of it.
+ */
+int ext_alloc(struct ext_mem *mem, unsigned long size)
+{
+	union REGS r;
+	unsigned int handle;
+
+	if (ext_kind == EXT_NONE || num_ext_handles == MAX_EXT_HANDLES)
+		return 1;
+	if (ext_kind == EXT_XMS) {
+		handle = (size + 1023) >> 10;
+		if (xms_call(0x09, &handle) != 1)	/* XMS function 0x09 - Allocate extended memory block */
+			return 1;
+	} else {
+		r.h.ah = 0x43;
+		r.x.bx = (size + EMS_PAGE - 1) / EMS_PAGE;
+		int86(0x67, &r, &r);	/* INT 0x67 function 0x43 - Allocate pages */
+		if (r.h.ah != 0)
+			return 1;
+		handle = r.x.dx;
+	}
+	mem->handle = handle;
+	mem->size = size;
+	ext_handles[num_ext_handles++] = handle;
+	return 0;
+}
+
+/* read_failed - report the image read error set by image_fetch() or the functions it calls and exit */
+void read_failed()
+{
+	printf("ERROR: %s.\n", read_error);
+	exit(6);
+}
+
+/* xms_move - move count (even) bytes between the XMS block and seg:offset, return non-zero on errors */
+int xms_move(struct ext_mem *mem, unsigned long pos, __segment seg, unsigned int offset,
+	      unsigned int count, int store)
+{
+	unsigned int handle = 0;
+	unsigned long address = ((unsigned long) seg << 16) | offset;
+
+	xms_block.length = count;
+	if (store) {
+		xms_block.src_handle = 0;
+		xms_block.src_offset = address;
+		xms_block.dst_handle = mem->handle;
+		xms_block.dst_offset = pos;
+	} else {
+		xms_block.src_handle = mem->handle;
+		xms_block.src_offset = pos;
+		xms_block.dst_handle = 0;
+		xms_block.dst_offset = address;
+	}
+	if (xms_call(0x0B, &handle) != 1) {	/* XMS function 0x0B - Move extended memory block */
+		strcpy(read_error, "Failed to access XMS memory");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * ext_move - copy count bytes between the XMS or EMS block at pos and seg:0
+ * Stores the data to the block if store is set, loads it from the block otherwise.
+ * Returns non-zero and sets read_error if the XMS or EMS driver fails.
+ */
+int ext_move(struct ext_mem *mem, unsigned long pos, __segment seg, unsigned int count, int store)
+{
+	union REGS r;
+	unsigned int offset = 0, chunk, frame_offset;
+	__segment frame_seg = ems_frame;
+	__segment word_seg;
+	unsigned int last = count - 1;
+	unsigned char __far *tail;
 
-			if (rom_data != file_data) {
-				printf("WARNING: Difference found at 0x%04X:%04X: ROM = 0x%02X; file 0x%02X\n", rom_seg, (unsigned int) offset, rom_data, file_data);
-				diff++;
+	if (ext_kind == EXT_XMS) {
+		if (count > 1 && xms_move(mem, pos, seg, 0, count & ~1, store) != 0)
+			return 1;
+		if (count & 1) {
+			/* move the last byte through a word buffer, XMS blocks have even size */
+			tail = MK_FP(seg, last);
+			word_seg = FP_SEG(&ext_word);
+			if (xms_move(mem, pos + last, word_seg, FP_OFF(&ext_word), 2, 0) != 0)
+				return 1;
+			if (store) {
+				ext_word = (ext_word & 0xFF00) | *tail;
+				if (xms_move(mem, pos + last, word_seg, FP_OFF(&ext_word), 2, 1) != 0)
+					return 1;
+			} else {
+				*tail = ext_word;
 			}
 		}
-		/* advance addresses by 64 KiB by incrementing the segment */
-		rom_seg += 0x1000;
-		file_seg += 0x1000;
-		bytes_to_verify -= verify_size;
+		return 0;
 	}
 
-	if (diff > 0) {
-		printf("WARNING: %d differences found\n", diff);
-	} else {
-		printf("No differences found\n");
+	/* map the EMS pages to the first physical page of the frame one by one */
+	while (count > 0) {
+		r.h.ah = 0x44;
+		r.h.al = 0;
+		r.x.bx = pos / EMS_PAGE;
+		r.x.dx = mem->handle;
+		int86(0x67, &r, &r);	/* INT 0x67 function 0x44 - Map logical page */
+		if (r.h.ah != 0) {
+			strcpy(read_error, "Failed to access EMS memory");
+			return 1;
+		}
+		frame_offset = pos % EMS_PAGE;
+		chunk = EMS_PAGE - frame_offset;
+		if (chunk > count)
+			chunk = count;
+		if (store)
+			_fmemcpy(MK_FP(frame_seg, frame_offset), MK_FP(seg, offset), chunk);
+		else
+			_fmemcpy(MK_FP(seg, offset), MK_FP(frame_seg, frame_offset), chunk);
+		pos += chunk;
+		offset += chunk;
+		count -= chunk;
 	}
+	return 0;
 }
 
-/* rom_read - DUMP ROM content to a file */
-void rom_read(__segment rom_seg, char *out_file, unsigned long rom_size) {
-	FILE *fp_out;
-	size_t count, write_size;
-	unsigned long bytes_to_write = rom_size;
+/* ext_store - copy count bytes from seg:0 to the XMS or EMS block at pos, exit on errors */
+void ext_store(struct ext_mem *mem, unsigned long pos, __segment seg, unsigned int count)
+{
+	if (ext_move(mem, pos, seg, count, 1) != 0) {
+		printf("ERROR: %s.\n", read_error);
+		exit(5);
+	}
+}
 
-	printf("Saving ROM content to %s, size %lu bytes.\n",
-		out_file, rom_size);
+/*
+ * file_fetch - read size bytes from the file to buf_seg:0
+ * Uses DOS read function directly, bypassing stdio buffering.
+ * Returns non-zero and sets read_error on errors.
+ */
+int file_fetch(int handle, char *name, __segment buf_seg, unsigned long size)
+{
+	unsigned int count, read_size;
+	unsigned long bytes = size, start = bench_start();
 
-	if ((fp_out = fopen(out_file, "wb")) == NULL) {
-		printf("ERROR: Failed to create %s: %s.\n",
-		       out_file, strerror(errno));
-		exit(2);
+	while (size > 0) {
+		if (size > DOS_CHUNK) {
+			read_size = DOS_CHUNK;
+		} else {
+			read_size = size;
+		}
+		if (_dos_read(handle, MK_FP(buf_seg, 0), read_size, &count) != 0) {
+			sprintf(read_error, "Failed to read %s: %s", name, strerror(errno));
+			return 1;
+		}
+		if (count != read_size) {
+			sprintf(read_error, "Short read while reading %s. Read %u bytes, expected to read %u bytes",
+				name, count, read_size);
+			return 1;
+		}
+		buf_seg += DOS_CHUNK >> 4;
+		size -= read_size;
 	}
-	
-	while (bytes_to_write > 0) {
-		if (bytes_to_write > 0x8000) {
-			write_size = 0x8000;
+	bench_stop(BENCH_FILE_READ, start, bytes);
+	return 0;
+}
+
+/* file_read - read size bytes from the file to buf_seg:0, exit on errors */
+void file_read(int handle, char *name, __segment buf_seg, unsigned long size)
+{
+	if (file_fetch(handle, name, buf_seg, size) != 0)
+		read_failed();
+}
+
+/* file_write - write size bytes from buf_seg:0 to the file, exit on errors */
+void file_write(int handle, char *name, __segment buf_seg, unsigned long size)
+{
+	unsigned int count, write_size;
+	unsigned long bytes = size, start = bench_start();
+
+	while (size > 0) {
+		if (size > DOS_CHUNK) {
+			write_size = DOS_CHUNK;
 		} else {
-			write_size = bytes_to_write;
+			write_size = size;
+		}
+		if (_dos_write(handle, MK_FP(buf_seg, 0), write_size, &count) != 0) {
+			printf("ERROR: Failed to write %s: %s.\n", name, strerror(errno));
+			exit(3);
 		}
-		if ((count = fwrite(rom_seg:>0, 1, write_size, fp_out)) != write_size) {
+		if (count != write_size) {
 			printf("ERROR: Short write while writing %s. Wrote %u bytes, expected to write %u bytes.\n",
-				out_file, count, write_size);
+			       name, count, write_size);
 			exit(3);
 		}
-		/* advance write address by 32 KiB by incrementing the segment */
-		rom_seg += 0x0800;
-		bytes_to_write -= write_size;
+		buf_seg += DOS_CHUNK >> 4;
+		size -= write_size;
 	}
-	fclose(fp_out);
+	bench_stop(BENCH_FILE_WRITE, start, bytes);
 }
 
-__segment load_file(char *in_file, unsigned long *rom_size) {
-	FILE *fp_in;
-	size_t count, read_size;
-	unsigned long bytes_to_read, buf_addr;
-	__segment file_segment, read_segment;
-	struct stat st;
-
-	if (stat(in_file, &st) == -1) {
-		printf("ERROR: Failed to stat %s: %s.\n",
-			in_file, strerror(errno));
-		exit(4);
+/*
+ * lz_decode - decode in_size bytes of XLZ1 block at in_seg:0 to out_size bytes at out_seg:0
+ * Each flag byte describes the next 8 items, starting from bit 0: 1 - literal byte,
+ * 0 - match: two bytes with 12-bit distance - 1, and 4-bit length - LZ_MIN_MATCH.
+ * Returns non-zero if the block is corrupted.
+ */
+unsigned int lz_decode(__segment in_seg, unsigned int in_size, __segment out_seg, unsigned int out_size)
+{
+	unsigned int status = 1;
+#ifdef USE_ASM
+	__asm {
+		push	ds
+		push	es
+		push	si
+		push	di
+		push	dx
+		push	cx
+		push	bx
+		push	ax
+		mov	ax,out_seg
+		mov	es,ax
+		mov	ax,in_seg
+		mov	ds,ax
+		xor	si,si
+		xor	di,di
+		cld
+	lz_group:
+		cmp	di,out_size
+		jae	lz_ok
+		cmp	si,in_size
+		jae	lz_done
+		lodsb
+		mov	dl,al			/* DL - flags, DH - items left in the group */
+		mov	dh,8
+	lz_item:
+		cmp	di,out_size
+		jae	lz_ok
+		shr	dl,1
+		jnc	lz_match
+		cmp	si,in_size
+		jae	lz_done
+		movsb				/* literal byte */
+		jmp	lz_next
+	lz_match:
+		mov	ax,si
+		inc	ax
+		cmp	ax,in_size
+		jae	lz_done
+		lodsw				/* AL - distance low, AH - distance high and length */
+		mov	cl,ah
+		xor	ch,ch
+		and	cl,0x0F
+		add	cx,LZ_MIN_MATCH
+		mov	bl,ah
+		and	bl,0xF0
+		xor	bh,bh
+		shl	bx,1
+		shl	bx,1
+		shl	bx,1
+		shl	bx,1
+		mov	bl,al
+		inc	bx			/* BX - distance */
+		cmp	bx,di
+		ja	lz_done			/* points before the start of the block */
+		mov	ax,out_size
+		sub	ax,di
+		cmp	cx,ax
+		jbe	lz_copy
+		mov	cx,ax			/* don't write past the end of the block */
+	lz_copy:
+		push	ds
+		push	si
+		mov	si,di
+		sub	si,bx
+		mov	ax,es
+		mov	ds,ax
+		rep	movsb			/* overlapping copy repeats the pattern */
+		pop	si
+		pop	ds
+	lz_next:
+		dec	dh
+		jnz	lz_item
+		jmp	lz_group
+	lz_ok:
+		mov	status,0
+	lz_done:
+		pop	ax
+		pop	bx
+		pop	cx
+		pop	dx
+		pop	di
+		pop	si
+		pop	es
+		pop	ds
 	}
+#else
+	unsigned char __far *in = MK_FP(in_seg, 0);
+	unsigned char __far *out = MK_FP(out_seg, 0);
+	unsigned int in_pos = 0, out_pos = 0, flags, item, distance, length;
 
-	*rom_size = st.st_size;
-	if (*rom_size == 0) {
-		printf("ERROR: File %s is empty.\n", in_file);
+	while (out_pos < out_size) {
+		if (in_pos >= in_size)
+			return status;
+		flags = in[in_pos++];
+		for (item = 0; item < 8 && out_pos < out_size; item++, flags >>= 1) {
+			if (flags & 1) {
+				if (in_pos >= in_size)
+					return status;
+				out[out_pos++] = in[in_pos++];
+				continue;
+			}
+			if (in_pos + 1 >= in_size)
+				return status;
+			distance = (((unsigned int) in[in_pos + 1] & 0xF0) << 4) + in[in_pos] + 1;
+			length = (in[in_pos + 1] & 0x0F) + LZ_MIN_MATCH;
+			in_pos += 2;
+			if (distance > out_pos)
+				return status;
+			if (length > out_size - out_pos)
+				length = out_size - out_pos;
+			for (; length > 0; length--, out_pos++)
+				out[out_pos] = out[out_pos - distance];
+		}
+	}
+	status = 0;
+#endif
+	return status;
+}
+
+/*
+ * lz_encode - compress in_size (up to LZ_BLOCK) bytes at in_seg:0 to out_seg:0
+ * Looks for matches at the last position with the same hash, and at the previous
+ * byte for runs. Returns the compressed size, at most LZ_MAX_BLOCK bytes.
+ */
+unsigned int lz_encode(__segment in_seg, unsigned int in_size, __segment out_seg)
+{
+	unsigned char __far *in = MK_FP(in_seg, 0);
+	unsigned char __far *out = MK_FP(out_seg, 0);
+	unsigned int pos = 0, out_pos = 0, flag_pos = 0, bit = 8, i, length, best_length, best_distance;
+	unsigned int candidate[2];
+
+	for (i = 0; i < LZ_HASH_SIZE; i++)
+		lz_head[i] = 0xFFFF;
+
+	while (pos < in_size) {
+		if (bit == 8) {
+			flag_pos = out_pos++;
+			out[flag_pos] = 0;
+			bit = 0;
+		}
+		best_length = 0;
+		if (pos + LZ_MIN_MATCH <= in_size) {
+			candidate[0] = lz_head[LZ_HASH(in, pos)];
+			candidate[1] = pos - 1;
+			for (i = 0; i < 2; i++) {
+				if (candidate[i] >= pos)
+					continue;	/* no position with this hash yet, or pos is 0 */
+				for (length = 0; length < LZ_MAX_MATCH && pos + length < in_size &&
+				     in[candidate[i] + length] == in[pos + length]; length++)
+					;
+				if (length > best_length) {
+					best_length = length;
+					best_distance = pos - candidate[i];
+				}
+			}
+		}
+		if (best_length >= LZ_MIN_MATCH) {
+			out[out_pos++] = (best_distance - 1) & 0xFF;
+			out[out_pos++] = (((best_distance - 1) >> 4) & 0xF0) | (best_length - LZ_MIN_MATCH);
+		} else {
+			out[flag_pos] |= 1 << bit;
+			out[out_pos++] = in[pos];
+			best_length = 1;
+		}
+		for (; best_length > 0; best_length--, pos++)
+			if (pos + LZ_MIN_MATCH <= in_size)
+				lz_head[LZ_HASH(in, pos)] = pos;
+		bit++;
+	}
+	return out_pos;
+}
+
+/*
+ * lz_next_block - read and decode the next block of the compressed image, return its size
+ * Returns 0 and sets read_error if the block can't be read or decoded.
+ */
+unsigned int lz_next_block(struct image *image, __segment out_seg, unsigned long out_pos)
+{
+	__segment in_seg = image->lz_in_seg;
+	unsigned char __far *block_header = MK_FP(in_seg, 0);
+	unsigned int in_size, out_size;
+
+	if (image->size - out_pos > LZ_BLOCK) {
+		out_size = LZ_BLOCK;
+	} else {
+		out_size = image->size - out_pos;
+	}
+	if (file_fetch(image->handle, image->name, in_seg, 2) != 0)
+		return 0;
+	/* the compressed size of the block, little endian */
+	in_size = block_header[0] | ((unsigned int) block_header[1] << 8);
+	if (in_size <= LZ_MAX_BLOCK && file_fetch(image->handle, image->name, in_seg, in_size) != 0)
+		return 0;
+	if (in_size > LZ_MAX_BLOCK || lz_decode(in_seg, in_size, out_seg, out_size) != 0) {
+		sprintf(read_error, "Compressed image %s is corrupted", image->name);
+		return 0;
+	}
+	return out_size;
+}
+
+/*
+ * lz_read - decode the next size bytes of the streamed compressed image to buf_seg:0
+ * Returns non-zero and sets read_error on errors.
+ */
+int lz_read(struct image *image, __segment buf_seg, unsigned int size)
+{
+	__segment block_seg = image->lz_block_seg;
+	unsigned int offset = 0, start, count;
+
+	while (size > 0) {
+		if (image->lz_block_pos == image->lz_block_size) {
+			if ((image->lz_block_size = lz_next_block(image, block_seg, image->lz_decoded)) == 0)
+				return 1;
+			image->lz_decoded += image->lz_block_size;
+			image->lz_block_pos = 0;
+		}
+		count = image->lz_block_size - image->lz_block_pos;
+		if (count > size)
+			count = size;
+		start = image->lz_block_pos;
+		_fmemcpy(MK_FP(buf_seg, offset), MK_FP(block_seg, start), count);
+		image->lz_block_pos += count;
+		offset += count;
+		size -= count;
+	}
+	return 0;
+}
+
+/* file_write_buf - write size bytes from the buffer to the file, exit on errors */
+void file_write_buf(int handle, char *name, void __far *buf, unsigned int size)
+{
+	unsigned int count;
+
+	if (_dos_write(handle, buf, size, &count) != 0 || count != size) {
+		printf("ERROR: Failed to write %s: %s.\n", name, strerror(errno));
+		exit(3);
+	}
+}
+
+/* crc16_init - fill the CRC-16-CCITT table used by XMODEM-CRC */
+void crc16_init()
+{
+	unsigned int i, bit, crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i << 8;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		crc16_table[i] = crc;
+	}
+}
+
+/*
+ * serial_open - set the image to be received with XMODEM-CRC from the serial port
+ * spec is COMn[:baud], the default rate is 115200. The image size is specified
+ * with -s option, as XMODEM doesn't transfer the file size.
+ */
+void serial_open(struct image *image, char *spec, unsigned long size)
+{
+	unsigned short __far *bios_data = MK_FP(0x0040, 0);	/* COM1 - COM4 base addresses */
+	unsigned int port;
+	unsigned long baud = 115200;
+	unsigned int divisor;
+
+	if (sscanf(spec, "COM%u:%lu", &port, &baud) < 1 || port < 1 || port > 4 ||
+	    baud < 2 || baud > 115200)
+		error("Invalid serial port. Please specify COM1 - COM4 and the baud rate, for example -S COM1:115200.");
+	if ((serial_port = bios_data[port - 1]) == 0) {
+		printf("ERROR: Serial port COM%u is not installed.\n", port);
+		exit(4);
+	}
+
+	/* 8 data bits, no parity, 1 stop bit, no interrupts, enable 16550 FIFOs, DTR and RTS on */
+	divisor = 115200 / baud;
+	outp(serial_port + UART_LCR, 0x80);
+	outp(serial_port + UART_DATA, divisor & 0xFF);
+	outp(serial_port + UART_IER, divisor >> 8);
+	outp(serial_port + UART_LCR, 0x03);
+	outp(serial_port + UART_IER, 0);
+	outp(serial_port + UART_FCR, 0x07);
+	outp(serial_port + UART_MCR, 0x03);
+	while (inp(serial_port + UART_LSR) & 0x01)
+		inp(serial_port + UART_DATA);
+
+	crc16_init();
+	xmodem_block = 1;
+	xmodem_pos = 0;
+	xmodem_size = 0;
+	xmodem_response = XMODEM_CRC;
+
+	image->name = spec;
+	image->handle = -1;
+	image->serial = 1;
+	image->size = size;
+	image->pos = 0;
+	image->buf = NULL;
+	image->next_buf = NULL;
+	image->ahead = 0;
+	image->buf_size = 0;
+	image->compressed = 0;
+	image->extended = 0;
+	printf("Receiving flash ROM image with XMODEM-CRC from COM%u at %lu baud, size %lu bytes.\n",
+	       port, baud, size);
+	printf("Start the transfer on the other side when ready.\n");
+}
+
+/* serial_getc - return the next received byte, or -1 if nothing is received within timeout ticks */
+int serial_getc(unsigned long timeout)
+{
+	unsigned int i;
+
+	/* poll without the timer first, there is no time for it between the bytes at high rates */
+	for (i = 0; i < SERIAL_SPIN; i++)
+		if (inp(serial_port + UART_LSR) & 0x01)
+			return inp(serial_port + UART_DATA);
+	pit_start(timeout);
+	while (!(inp(serial_port + UART_LSR) & 0x01))
+		if (pit_expired())
+			return -1;
+	return inp(serial_port + UART_DATA);
+}
+
+void serial_putc(unsigned char ch)
+{
+	while (!(inp(serial_port + UART_LSR) & 0x20))
+		;
+	outp(serial_port + UART_DATA, ch);
+}
+
+/* serial_purge - discard the received data until the line is silent for a second */
+void serial_purge()
+{
+	while (serial_getc(MS_TO_TICKS(1000)) != -1)
+		;
+}
+
+/* xmodem_cancel - abort the transfer, set read_error to the message and return -1 */
+int xmodem_cancel(char *message)
+{
+	serial_putc(XMODEM_CAN);
+	serial_putc(XMODEM_CAN);
+	sprintf(read_error, "XMODEM transfer failed: %s", message);
+	return -1;
+}
+
+/*
+ * xmodem_receive - receive the next XMODEM-CRC block into xmodem_buf
+ * The previous block is acknowledged only when the next one is needed, so the sender
+ * waits while the flash ROM is erased or programmed, and no data overruns the UART.
+ * Returns 0 if a block is received, 1 at the end of the transfer, -1 if the transfer
+ * is canceled.
+ */
+int xmodem_receive()
+{
+	unsigned int attempt, i, size;
+	unsigned short crc;
+	int ch, block, block_inv, crc_hi, crc_lo;
+
+	for (attempt = 0; ; attempt++) {
+		/* the sender might be waiting for the user to start it, keep asking for a minute */
+		if (attempt >= (xmodem_response == XMODEM_CRC ? XMODEM_START_TRIES : XMODEM_RETRIES))
+			return xmodem_cancel("too many errors or timeouts");
+		serial_putc(xmodem_response);
+		ch = serial_getc(MS_TO_TICKS(xmodem_response == XMODEM_CRC ? 3000 : 10000));
+		if (ch == -1) {
+			if (xmodem_response != XMODEM_CRC)
+				xmodem_response = XMODEM_NAK;
+			continue;
+		}
+		if (ch == XMODEM_EOT) {
+			serial_putc(XMODEM_ACK);
+			return 1;
+		}
+		if (ch == XMODEM_CAN)
+			return xmodem_cancel("canceled by the sender");
+		if (ch != XMODEM_SOH && ch != XMODEM_STX) {
+			serial_purge();
+			xmodem_response = XMODEM_NAK;
+			continue;
+		}
+		size = (ch == XMODEM_SOH) ? 128 : 1024;
+		block = serial_getc(MS_TO_TICKS(1000));
+		block_inv = serial_getc(MS_TO_TICKS(1000));
+		for (i = 0; i < size && (ch = serial_getc(MS_TO_TICKS(1000))) != -1; i++)
+			xmodem_buf[i] = ch;
+		crc_hi = serial_getc(MS_TO_TICKS(1000));
+		crc_lo = serial_getc(MS_TO_TICKS(1000));
+		crc = 0;
+		for (i = 0; i < size; i++)
+			crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ xmodem_buf[i]];
+		/* a byte that timed out is -1, the block is received again */
+		if (block == -1 || block_inv == -1 || ch == -1 || crc_hi == -1 || crc_lo == -1 ||
+		    block + block_inv != 0xFF || crc != (((unsigned int) crc_hi << 8) | crc_lo)) {
+			serial_purge();
+			xmodem_response = XMODEM_NAK;
+			continue;
+		}
+		xmodem_response = XMODEM_ACK;
+		if (block == ((xmodem_block - 1) & 0xFF)) {
+			attempt = 0;	/* the sender didn't get the acknowledgment, skip the repeated block */
+			continue;
+		}
+		if (block != xmodem_block)
+			return xmodem_cancel("block sequence error");
+		xmodem_block++;
+		xmodem_pos = 0;
+		xmodem_size = size;
+		return 0;
+	}
+}
+
+/*
+ * serial_read - copy the next size bytes of the received image to buf_seg:0
+ * Returns non-zero and sets read_error if the transfer fails or ends early.
+ */
+int serial_read(struct image *image, __segment buf_seg, unsigned int size)
+{
+	unsigned int offset = 0, count;
+	unsigned long start = bench_start();
+	int status;
+
+	while (size > 0) {
+		if (xmodem_pos == xmodem_size && (status = xmodem_receive()) != 0) {
+			if (status == 1)
+				sprintf(read_error, "XMODEM transfer ended before %lu bytes of %s were received",
+					image->size, image->name);
+			return 1;
+		}
+		count = xmodem_size - xmodem_pos;
+		if (count > size)
+			count = size;
+		_fmemcpy(MK_FP(buf_seg, offset), &xmodem_buf[xmodem_pos], count);
+		xmodem_pos += count;
+		offset += count;
+		size -= count;
+	}
+	bench_stop(BENCH_FILE_READ, start, offset);
+	return 0;
+}
+
+/* xmodem_abort - cancel the rest of the transfer when the image isn't read to the end */
+void xmodem_abort()
+{
+	serial_putc(XMODEM_CAN);
+	serial_putc(XMODEM_CAN);
+	serial_purge();
+	xmodem_response = XMODEM_CAN;
+}
+
+/* serial_close - acknowledge the rest of the transfer, the data after the image is ignored */
+void serial_close(struct image *image)
+{
+	unsigned int extra = 0;
+	int status;
+
+	if (xmodem_response == XMODEM_CAN)
+		return;
+	do {
+		for (; xmodem_pos < xmodem_size; xmodem_pos++)
+			if (xmodem_buf[xmodem_pos] != XMODEM_PAD)
+				extra = 1;
+	} while ((status = xmodem_receive()) == 0);
+	if (status == -1)
+		printf("WARNING: %s.\n", read_error);
+	if (extra)
+		printf("WARNING: Ignored the data received after %lu bytes of %s.\n", image->size, image->name);
+}
+
+/*
+ * image_load_ext - load the opened image file into the allocated XMS or EMS block
+ * The file is read through a small buffer in conventional memory.
+ */
+void image_load_ext(struct image *image)
+{
+	unsigned int chunk_size;
+	unsigned long loaded;
+	__segment buf_seg;
+	void __huge *buf;
+
+	printf("Loading %sflash ROM image from %s to %s memory, size %lu bytes.\n",
+		image->compressed ? "compressed " : "", image->name, ext_names[ext_kind], image->size);
+	if ((buf_seg = seg_alloc(LZ_BLOCK, &buf)) == 0) {
+		printf("ERROR: Failed to allocate %u bytes for input buffer.\n", LZ_BLOCK);
+		exit(5);
+	}
+	for (loaded = 0; loaded < image->size; loaded += chunk_size) {
+		if (image->compressed) {
+			if ((chunk_size = lz_next_block(image, buf_seg, loaded)) == 0)
+				read_failed();
+		} else {
+			chunk_size = (image->size - loaded > LZ_BLOCK) ? LZ_BLOCK : image->size - loaded;
+			file_read(image->handle, image->name, buf_seg, chunk_size);
+		}
+		ext_store(&image->ext, loaded, buf_seg, chunk_size);
+	}
+	hfree(buf);
+	if (image->compressed) {
+		hfree(image->lz_in_buf);
+		image->compressed = 0;
+	}
+	_dos_close(image->handle);
+	image->handle = -1;
+	image->extended = 1;
+	image->ext_pos = 0;
+}
+
+/*
+ * image_open - open the image file, and load it to memory unless stream is set
+ * If there is not enough memory for the image, it is streamed from the file.
+ */
+void image_open(struct image *image, char *in_file, int stream)
+{
+	int handle;
+	struct stat st;
+	unsigned char header[LZ_HEADER_SIZE];
+	unsigned int count;
+	unsigned long decoded, blocks, compressed;
+	__segment data_seg;
+
+	if (stat(in_file, &st) == -1) {
+		printf("ERROR: Failed to stat %s: %s.\n",
+			in_file, strerror(errno));
+		exit(4);
+	}
+
+	image->name = in_file;
+	image->size = st.st_size;
+	image->pos = 0;
+	image->buf = NULL;
+	image->next_buf = NULL;
+	image->ahead = 0;
+	image->buf_size = 0;
+	image->extended = 0;
+	image->serial = 0;
+	if (image->size == 0) {
+		printf("ERROR: File %s is empty.\n", in_file);
+		exit(4);
+	}
+
+	if (_dos_open(in_file, O_RDONLY, &handle) != 0) {
+		printf("ERROR: Failed to open %s for reading: %s.\n",
+		       in_file, strerror(errno));
 		exit(4);
 	}
+	image->handle = handle;
+
+	/* compressed images start with the magic followed by the image size */
+	image->compressed = 0;
+	if (_dos_read(handle, header, LZ_HEADER_SIZE, &count) == 0 && count == LZ_HEADER_SIZE &&
+	    memcmp(header, LZ_MAGIC, 4) == 0) {
+		image->compressed = 1;
+		image->size = header[4] | ((unsigned int) header[5] << 8) |
+			      ((unsigned long) header[6] << 16) | ((unsigned long) header[7] << 24);
+		/*
+		 * check the size before allocating memory for it, each block takes 3 bytes
+		 * at least and LZ_MAX_BLOCK bytes at most, plus its 2 byte size
+		 */
+		blocks = (image->size + LZ_BLOCK - 1) / LZ_BLOCK;
+		compressed = st.st_size - LZ_HEADER_SIZE;
+		if (image->size == 0 || image->size > LZ_MAX_IMAGE ||
+		    compressed < blocks * 3 || compressed > blocks * (LZ_MAX_BLOCK + 2)) {
+			printf("ERROR: Compressed image %s is corrupted, image size %lu bytes.\n",
+			       in_file, image->size);
+			exit(6);
+		}
+		if ((image->lz_in_seg = seg_alloc(LZ_MAX_BLOCK, &image->lz_in_buf)) == 0) {
+			printf("ERROR: Failed to allocate %u bytes for input buffer.\n", LZ_MAX_BLOCK);
+			exit(5);
+		}
+	} else {
+		lseek(handle, 0, SEEK_SET);
+	}
+
+	/*
+	 * XMS or EMS memory is used only if the image doesn't fit in conventional memory or
+	 * it is read page by page, an image in it can't be programmed to the area of the disk
+	 * I/O interrupt handlers
+	 */
+	if (!stream && (image->seg = seg_alloc(image->size, &image->buf)) == 0) {
+		if ((options & OPT_EXT) && ext_alloc(&image->ext, image->size) == 0) {
+			image_load_ext(image);
+			return;
+		}
+		printf("WARNING: Not enough memory to load %lu bytes, using low memory mode.\n",
+		       image->size);
+		stream = 1;
+	} else if (stream && (options & OPT_EXT) && ext_alloc(&image->ext, image->size) == 0) {
+		image_load_ext(image);
+		return;
+	}
+
+	if (stream) {
+		printf("Reading %sflash ROM image from %s page by page, size %lu bytes.\n",
+			image->compressed ? "compressed " : "", in_file, image->size);
+		if (image->compressed) {
+			if ((image->lz_block_seg = seg_alloc(LZ_BLOCK, &image->lz_block_buf)) == 0) {
+				printf("ERROR: Failed to allocate %u bytes for input buffer.\n", LZ_BLOCK);
+				exit(5);
+			}
+			image->lz_block_pos = 0;
+			image->lz_block_size = 0;
+			image->lz_decoded = 0;
+		}
+		return;
+	}
+
+	printf("Loading %sflash ROM image from %s, size %lu bytes.\n",
+		image->compressed ? "compressed " : "", in_file, image->size);
+
+	if (image->compressed) {
+		/* decode the blocks in place */
+		data_seg = image->seg;
+		for (decoded = 0; decoded < image->size; decoded += LZ_BLOCK) {
+			if (lz_next_block(image, data_seg, decoded) == 0)
+				read_failed();
+			data_seg += LZ_BLOCK >> 4;
+		}
+		hfree(image->lz_in_buf);
+	} else {
+		file_read(handle, in_file, image->seg, image->size);
+	}
+	_dos_close(handle);
+	image->handle = -1;
+}
+
+/*
+ * image_read - read size bytes of the streamed image into the buffer, decoding it if compressed
+ * Returns non-zero and sets read_error if the image can't be read.
+ */
+int image_read(struct image *image, __segment buf_seg, unsigned int size)
+{
+	if (image->serial)
+		return serial_read(image, buf_seg, size);
+	if (image->extended) {
+		image->ext_pos += size;
+		return ext_move(&image->ext, image->ext_pos - size, buf_seg, size, 0);
+	}
+	if (image->compressed)
+		return lz_read(image, buf_seg, size);
+	return file_fetch(image->handle, image->name, buf_seg, size);
+}
+
+/* image_streamed - check if the image is read into a buffer in parts instead of being in memory */
+int image_streamed(struct image *image)
+{
+	return image->handle != -1 || image->extended || image->serial;
+}
+
+/*
+ * image_fetch - return the segment of the next size bytes of the image
+ * Images in memory are returned in place, streamed images are read into the
+ * stream buffer. size must be a multiple of 16, except at the end of the image.
+ * Returns 0 and sets read_error if the image can't be read.
+ */
+__segment image_fetch(struct image *image, unsigned int size)
+{
+	__segment buf_seg;
+	void __huge *buf;
+
+	if (!image_streamed(image)) {
+		buf_seg = image->seg + (unsigned int) (image->pos >> 4);
+	} else if (image->ahead) {
+		/* the data was read by image_prefetch(), swap the stream buffers */
+		buf_seg = image->next_seg;
+		image->next_seg = image->seg;
+		image->seg = buf_seg;
+		buf = image->next_buf;
+		image->next_buf = image->buf;
+		image->buf = buf;
+		image->ahead = 0;
+	} else {
+		if (size > image->buf_size) {
+			if (image->buf != NULL)
+				hfree(image->buf);
+			if (image->next_buf != NULL)
+				hfree(image->next_buf);
+			image->next_buf = NULL;
+			if ((image->seg = seg_alloc(size, &image->buf)) == 0) {
+				image->buf_size = 0;
+				sprintf(read_error, "Failed to allocate %u bytes for input buffer", size);
+				return 0;
+			}
+			image->buf_size = size;
+		}
+		buf_seg = image->seg;
+		if (image_read(image, buf_seg, size) != 0)
+			return 0;
+	}
+	image->pos += size;
+	return buf_seg;
+}
+
+/* image_next - return the segment of the next size bytes of the image, exit on errors */
+__segment image_next(struct image *image, unsigned int size)
+{
+	__segment buf_seg;
+
+	if ((buf_seg = image_fetch(image, size)) == 0)
+		read_failed();
+	return buf_seg;
+}
+
+/*
+ * image_prefetch - read the data for the next image_fetch(image, size) call ahead
+ * The data returned by the previous image_fetch() call remains valid.
+ * Returns non-zero and sets read_error if the image can't be read.
+ */
+int image_prefetch(struct image *image, unsigned int size)
+{
+	if (!image_streamed(image) || image->ahead || size > image->buf_size ||
+	    image->pos + size > image->size)
+		return 0;
+	if (image->next_buf == NULL &&
+	    (image->next_seg = seg_alloc(image->buf_size, &image->next_buf)) == 0)
+		return 0;	/* no memory for the second buffer, just don't read ahead */
+	if (image_read(image, image->next_seg, size) != 0)
+		return 1;
+	image->ahead = 1;
+	return 0;
+}
+
+/* image_compress - save the image to out_file in XLZ1 compressed format */
+void image_compress(struct image *image, char *out_file)
+{
+	unsigned char header[LZ_HEADER_SIZE], block_header[2];
+	unsigned int block_size, out_size;
+	unsigned long bytes_to_compress = image->size, compressed = LZ_HEADER_SIZE;
+	__segment out_seg;
+	void __huge *out_buf;
+	int handle;
+
+	if ((out_seg = seg_alloc(LZ_MAX_BLOCK, &out_buf)) == 0) {
+		printf("ERROR: Failed to allocate %u bytes for output buffer.\n", LZ_MAX_BLOCK);
+		exit(5);
+	}
+
+	printf("Compressing %s to %s.\n", image->name, out_file);
+	if (_dos_creat(out_file, _A_NORMAL, &handle) != 0) {
+		printf("ERROR: Failed to create %s: %s.\n",
+		       out_file, strerror(errno));
+		exit(2);
+	}
+	/* magic followed by the image size, little endian */
+	memcpy(header, LZ_MAGIC, 4);
+	header[4] = image->size;
+	header[5] = image->size >> 8;
+	header[6] = image->size >> 16;
+	header[7] = image->size >> 24;
+	file_write_buf(handle, out_file, header, LZ_HEADER_SIZE);
+
+	while (bytes_to_compress > 0) {
+		if (bytes_to_compress > LZ_BLOCK) {
+			block_size = LZ_BLOCK;
+		} else {
+			block_size = bytes_to_compress;
+		}
+		/* each block is preceded by its compressed size, little endian */
+		out_size = lz_encode(image_next(image, block_size), block_size, out_seg);
+		block_header[0] = out_size;
+		block_header[1] = out_size >> 8;
+		file_write_buf(handle, out_file, block_header, 2);
+		file_write(handle, out_file, out_seg, out_size);
+		compressed += out_size + 2;
+		bytes_to_compress -= block_size;
+	}
+	_dos_close(handle);
+	hfree(out_buf);
+	printf("Compressed %lu bytes to %lu bytes.\n", image->size, compressed);
+}
+
+/* image_rewind - start reading the image from the beginning */
+void image_rewind(struct image *image)
+{
+	if (image->serial && image->pos != 0) {
+		printf("ERROR: The image received from %s can't be read again.\n", image->name);
+		exit(6);
+	}
+	image->pos = 0;
+	image->ahead = 0;
+	if (image->handle != -1)
+		lseek(image->handle, image->compressed ? LZ_HEADER_SIZE : 0, SEEK_SET);
+	if (image->compressed) {
+		image->lz_block_pos = 0;
+		image->lz_block_size = 0;
+		image->lz_decoded = 0;
+	}
+	image->ext_pos = 0;
+}
+
+/* rom_read - DUMP ROM content to a file */
+void rom_read(__segment rom_seg, char *out_file, unsigned long rom_size) {
+	int handle;
+
+	printf("Saving ROM content to %s, size %lu bytes.\n",
+		out_file, rom_size);
+
+	if (_dos_creat(out_file, _A_NORMAL, &handle) != 0) {
+		printf("ERROR: Failed to create %s: %s.\n",
+		       out_file, strerror(errno));
+		exit(2);
+	}
+	file_write(handle, out_file, rom_seg, rom_size);
+	_dos_close(handle);
+}
+
+unsigned int checksum (__segment data_seg, unsigned long rom_size)
+{
+	unsigned int checksum_size;
+	unsigned short sum = 0;
+	unsigned long bytes_to_checksum = rom_size;
+#ifndef USE_ASM
+	unsigned int offset;
+#endif
+	while (bytes_to_checksum > 0) {
+		if (bytes_to_checksum > 0x8000) {
+			checksum_size = 0x8000;
+		} else {
+			checksum_size = bytes_to_checksum;
+		}
+#ifdef USE_ASM
+		__asm {
+			push	ds
+			push	si
+			push	cx
+			push	bx
+			push	ax
+			mov	bx,sum
+			mov	cx,checksum_size
+			mov	ax,data_seg
+			mov	ds,ax
+			xor	si,si
+			cld
+			shr	cx,1			/* add two bytes per iteration */
+			jcxz	sum_done
+		sum_loop:
+			lodsw
+			add	bl,al			/* add the low byte, fold the carry */
+			adc	bh,0
+			add	bl,ah			/* add the high byte, fold the carry */
+			adc	bh,0
+			loop	sum_loop
+		sum_done:
+			mov	sum,bx
+			pop	ax
+			pop	bx
+			pop	cx
+			pop	si
+			pop	ds
+		}
+		if (checksum_size & 1)
+			sum += ((unsigned char __far *) MK_FP(data_seg, 0))[checksum_size - 1];
+#else
+		for (offset = 0; offset < checksum_size; offset++) {
+			sum += ((unsigned char __far *) MK_FP(data_seg, 0))[offset];
+		}
+#endif
+		/* advance checksum address by 32 KiB by incrementing the segment */
+		data_seg += 0x0800;
+		bytes_to_checksum -= checksum_size;
+	}
+	return sum;
+}
+
+/* crc32_init - fill the CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320) lookup table */
+void crc32_init()
+{
+	unsigned int i, bit;
+	unsigned long crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+		crc32_table[i] = crc;
+	}
+}
+
+/* crc32_update - update the CRC-32 with count bytes at data_seg:0 */
+unsigned long crc32_update(unsigned long crc, __segment data_seg, unsigned int count)
+{
+#ifdef USE_ASM
+	unsigned int crc_low = crc, crc_high = crc >> 16;
+	__segment table_seg = FP_SEG(crc32_table);
+	unsigned int table_off = FP_OFF(crc32_table);
+
+	__asm {
+		push	ds
+		push	es
+		push	si
+		push	di
+		push	dx
+		push	cx
+		push	bx
+		push	ax
+		mov	ax,crc_low
+		mov	dx,crc_high
+		mov	cx,count
+		mov	di,table_off
+		mov	bx,table_seg
+		mov	es,bx
+		mov	bx,data_seg
+		mov	ds,bx
+		xor	si,si
+		jcxz	crc_done
+	crc_loop:
+		mov	bl,[si]
+		inc	si
+		xor	bl,al			/* table index = (crc ^ data) & 0xFF */
+		xor	bh,bh
+		shl	bx,1
+		shl	bx,1
+		mov	al,ah			/* crc = crc >> 8 */
+		mov	ah,dl
+		mov	dl,dh
+		xor	dh,dh
+		xor	ax,es:[bx+di]		/* crc = crc ^ crc32_table[index] */
+		xor	dx,es:[bx+di+2]
+		loop	crc_loop
+	crc_done:
+		mov	crc_low,ax
+		mov	crc_high,dx
+		pop	ax
+		pop	bx
+		pop	cx
+		pop	dx
+		pop	di
+		pop	si
+		pop	es
+		pop	ds
+	}
+	return ((unsigned long) crc_high << 16) | crc_low;
+#else
+	unsigned char __far *data = MK_FP(data_seg, 0);
+	unsigned int offset;
+
+	for (offset = 0; offset < count; offset++)
+		crc = (crc >> 8) ^ crc32_table[(unsigned char) crc ^ data[offset]];
+	return crc;
+#endif
+}
+
+#define ROL32(x, n) ((((x) << (n)) | (((x) & 0xFFFFFFFF) >> (32 - (n)))) & 0xFFFFFFFF)
+
+/* sha1_init - start a new SHA-1 digest */
+void sha1_init(struct sha1 *ctx)
+{
+	ctx->h[0] = 0x67452301;
+	ctx->h[1] = 0xEFCDAB89;
+	ctx->h[2] = 0x98BADCFE;
+	ctx->h[3] = 0x10325476;
+	ctx->h[4] = 0xC3D2E1F0;
+	ctx->length = 0;
+	ctx->fill = 0;
+}
+
+/* sha1_block - process one 64 byte block, using a 16 word window for the message schedule */
+void sha1_block(struct sha1 *ctx, unsigned char __far *data)
+{
+	unsigned long w[16], a, b, c, d, e, f, k, temp;
+	unsigned int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = ((unsigned long) data[i * 4] << 24) | ((unsigned long) data[i * 4 + 1] << 16) |
+		       ((unsigned int) data[i * 4 + 2] << 8) | data[i * 4 + 3];
+
+	a = ctx->h[0];
+	b = ctx->h[1];
+	c = ctx->h[2];
+	d = ctx->h[3];
+	e = ctx->h[4];
+	for (i = 0; i < 80; i++) {
+		if (i >= 16) {
+			temp = w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15];
+			w[i & 15] = ROL32(temp, 1);
+		}
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		temp = ROL32(a, 5) + f + e + k + w[i & 15];
+		e = d;
+		d = c;
+		c = ROL32(b, 30);
+		b = a;
+		a = temp;
+	}
+	ctx->h[0] += a;
+	ctx->h[1] += b;
+	ctx->h[2] += c;
+	ctx->h[3] += d;
+	ctx->h[4] += e;
+}
+
+/* sha1_update - add count bytes at data_seg:0 to the SHA-1 digest */
+void sha1_update(struct sha1 *ctx, __segment data_seg, unsigned int count)
+{
+	unsigned char __far *data = MK_FP(data_seg, 0);
+	unsigned int copy_size;
+
+	ctx->length += count;
+	while (count > 0) {
+		if (ctx->fill == 0 && count >= 64) {
+			/* process whole blocks in place */
+			sha1_block(ctx, data);
+			data += 64;
+			count -= 64;
+			continue;
+		}
+		copy_size = 64 - ctx->fill;
+		if (copy_size > count)
+			copy_size = count;
+		_fmemcpy(ctx->block + ctx->fill, data, copy_size);
+		ctx->fill += copy_size;
+		data += copy_size;
+		count -= copy_size;
+		if (ctx->fill == 64) {
+			sha1_block(ctx, ctx->block);
+			ctx->fill = 0;
+		}
+	}
+}
+
+/* sha1_final - pad the message and store the 20 byte SHA-1 digest */
+void sha1_final(struct sha1 *ctx, unsigned char *digest)
+{
+	unsigned int i;
+
+	ctx->block[ctx->fill++] = 0x80;
+	if (ctx->fill > 56) {
+		_fmemset(ctx->block + ctx->fill, 0, 64 - ctx->fill);
+		sha1_block(ctx, ctx->block);
+		ctx->fill = 0;
+	}
+	_fmemset(ctx->block + ctx->fill, 0, 56 - ctx->fill);
+	/* message length in bits, big endian */
+	ctx->block[56] = 0;
+	ctx->block[57] = 0;
+	ctx->block[58] = 0;
+	ctx->block[59] = ctx->length >> 29;
+	ctx->block[60] = ctx->length >> 21;
+	ctx->block[61] = ctx->length >> 13;
+	ctx->block[62] = ctx->length >> 5;
+	ctx->block[63] = ctx->length << 3;
+	sha1_block(ctx, ctx->block);
+
+	for (i = 0; i < 20; i++)
+		digest[i] = ctx->h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+/* digest_init - start computing the digests selected with -c options */
+void digest_init(struct digest *digest)
+{
+	digest->sum = 0;
+	if (digests & DIGEST_CRC32) {
+		crc32_init();
+		digest->crc32 = 0xFFFFFFFF;
+	}
+	if (digests & DIGEST_SHA1)
+		sha1_init(&digest->sha1);
+}
+
+/* digest_update - add count bytes at data_seg:0 to all selected digests */
+void digest_update(struct digest *digest, __segment data_seg, unsigned int count)
+{
+	if (digests & DIGEST_SUM)
+		digest->sum += checksum(data_seg, count);
+	if (digests & DIGEST_CRC32)
+		digest->crc32 = crc32_update(digest->crc32, data_seg, count);
+	if (digests & DIGEST_SHA1)
+		sha1_update(&digest->sha1, data_seg, count);
+}
+
+/* digest_rom - compute the selected digests of the ROM content in a single pass */
+void digest_rom(struct digest *digest, __segment data_seg, unsigned long rom_size)
+{
+	unsigned int digest_size;
+
+	while (rom_size > 0) {
+		if (rom_size > 0x8000) {
+			digest_size = 0x8000;
+		} else {
+			digest_size = rom_size;
+		}
+		digest_update(digest, data_seg, digest_size);
+		/* advance digest address by 32 KiB by incrementing the segment */
+		data_seg += 0x0800;
+		rom_size -= digest_size;
+	}
+}
+
+/* digest_image - compute the selected digests of the image in a single pass */
+void digest_image(struct digest *digest, struct image *image)
+{
+	unsigned int digest_size, chunk_size;
+	unsigned long bytes_to_digest = image->size;
+
+	chunk_size = image_streamed(image) ? STREAM_CHUNK : 0x8000;
+	while (bytes_to_digest > 0) {
+		if (bytes_to_digest > chunk_size) {
+			digest_size = chunk_size;
+		} else {
+			digest_size = bytes_to_digest;
+		}
+		digest_update(digest, image_next(image, digest_size), digest_size);
+		bytes_to_digest -= digest_size;
+	}
+}
+
+/* digest_label - print the beginning of a digest line, in_file is NULL for the ROM */
+void digest_label(char *kind, __segment rom_seg, char *in_file)
+{
+	if (in_file == NULL)
+		printf("Current ROM %s at 0x%X:0000 is ", kind, rom_seg);
+	else
+		printf("The %s of %s is ", kind, in_file);
+}
+
+/* digest_print - print the selected digests of the ROM at rom_seg, or of in_file if specified */
+void digest_print(struct digest *digest, __segment rom_seg, char *in_file)
+{
+	unsigned char sha1[20];
+	unsigned int i;
+
+	if (digests & DIGEST_SUM) {
+		digest_label("checksum", rom_seg, in_file);
+		printf("0x%X\n", digest->sum);
+	}
+	if (digests & DIGEST_CRC32) {
+		digest_label("CRC-32", rom_seg, in_file);
+		printf("0x%08lX\n", digest->crc32 ^ 0xFFFFFFFF);
+	}
+	if (digests & DIGEST_SHA1) {
+		sha1_final(&digest->sha1, sha1);
+		digest_label("SHA-1", rom_seg, in_file);
+		for (i = 0; i < 20; i++)
+			printf("%02x", sha1[i]);
+		printf("\n");
+	}
+}
+
+/*
+ * rom_range_in_use - check if the interrupt handlers used for disk I/O are in the ROM range
+ * Such a range can't be streamed while it is half-programmed.
+ */
+int rom_range_in_use(__segment rom_seg, unsigned long rom_size)
+{
+	/* timer, keyboard, XT hard disk, floppy, disk BIOS, and relocated floppy BIOS */
+	static unsigned char vectors[] = {0x08, 0x09, 0x0D, 0x0E, 0x13, 0x40};
+	unsigned short __far *ivt = MK_FP(0, 0);
+	unsigned long handler, start = (unsigned long) rom_seg << 4;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(vectors); i++) {
+		handler = ((unsigned long) ivt[vectors[i] * 2 + 1] << 4) + ivt[vectors[i] * 2];
+		if (handler >= start && handler < start + rom_size)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * rom_chip_in_use - check if the system might run code from the flash ROM chip
+ * The chip doesn't return data while it is busy erasing or programming. It is
+ * considered in use if it is located in the system BIOS area, any interrupt vector
+ * points to it, or it contains an option ROM, that might have hooked interrupts.
+ */
+int rom_chip_in_use(__segment chip_seg, unsigned long chip_size)
+{
+	unsigned short __far *ivt = MK_FP(0, 0);
+	unsigned char __far *option_rom;
+	unsigned long handler, start = (unsigned long) chip_seg << 4, end = start + chip_size;
+	unsigned int i;
+	__segment seg;
+
+	if (end > 0xE0000)
+		return 1;
+
+	for (i = 0; i < 256; i++) {
+		handler = ((unsigned long) ivt[i * 2 + 1] << 4) + ivt[i * 2];
+		if (handler >= start && handler < end)
+			return 1;
+	}
+
+	/* option ROMs start at 2 KiB boundaries with 0x55, 0xAA signature */
+	for (seg = chip_seg; ((unsigned long) seg << 4) < end; seg += 0x80) {
+		option_rom = MK_FP(seg, 0);
+		if (option_rom[0] == 0x55 && option_rom[1] == 0xAA)
+			return 1;
+	}
+	return 0;
+}
+
+/* eeprom_find - return index of the device in eeprom table, or -1 if not found */
+int eeprom_find(unsigned char vendor_id, unsigned char device_id)
+{
+	int index;
+
+	for (index = 0; index < (int) num_devices; index++)
+		if (eeproms[index].vendor_id == vendor_id && eeproms[index].device_id == device_id)
+			return index;
+	return -1;
+}
+
+/* chip_select - use the command addresses of the chip identified by rom_detect() */
+void chip_select(unsigned int chip)
+{
+	chip_current = chip;
+	cmd_addr1 = chips[chip].cmd_addr1;
+	cmd_addr2 = chips[chip].cmd_addr2;
+}
+
+/* chip_find - return the index of the chip identified for rom_seg, or -1 if it is not identified yet */
+int chip_find(__segment rom_seg)
+{
+	unsigned int chip;
+	__segment window = (rom_seg < 0xE000) ? rom_seg : 0xE000;
+
+	for (chip = 0; chip < num_chips; chip++)
+		if (chips[chip].window == window)
+			return chip;
+	return -1;
+}
+
+/* device_timing - parse typical/maximum timing of the device file, "-" if not used */
+int device_timing(char *text, unsigned int *typ, unsigned int *max)
+{
+	if (!strcmp(text, "-")) {
+		*typ = 0;
+		*max = 0;
+		return 1;
+	}
+	return sscanf(text, "%u/%u", typ, max) == 2 && *typ != 0 && *typ <= *max;
+}
+
+/*
+ * device_sectors - parse the sector map and the flags of a device file entry
+ * The map is a comma separated list of runs of equal sectors from the start of the
+ * device, for example 1x16K,2x8K,1x32K,3x32K. The sizes must add up to the device size.
+ * Returns non-zero if the entry is valid.
+ */
+int device_sectors(unsigned int index, char *map, char *flags)
+{
+	unsigned int run = 0;
+	unsigned long count, size, total = 0;
+	char *end, *flag;
+
+	eeproms[index].page_size = 0;
+	do {
+		count = strtoul(map, &end, 10);
+		if (*end != 'x' || run == MAX_SECTOR_RUNS)
+			return 0;
+		size = strtoul(end + 1, &end, 10);
+		if (*end == 'K' || *end == 'k') {
+			size *= 1024;
+			end++;
+		}
+		if (count == 0 || count > 1024 || size == 0 || size % 16 != 0 || size > 32768 ||
+		    (*end != ',' && *end != '\0'))
+			return 0;
+		eeproms[index].sectors[run].count = count;
+		eeproms[index].sectors[run].size = size;
+		if (size > eeproms[index].page_size)
+			eeproms[index].page_size = size;
+		total += count * size;
+		run++;
+		map = end + 1;
+	} while (*end == ',');
+	if (total != eeproms[index].size)
+		return 0;
+	for (; run < MAX_SECTOR_RUNS; run++)
+		eeproms[index].sectors[run].count = 0;
+	/* a single run is a uniform map */
+	if (eeproms[index].sectors[1].count == 0)
+		eeproms[index].sectors[0].count = 0;
+
+	eeproms[index].need_erase = 0;
+	eeproms[index].page_write = 0;
+	eeproms[index].caps = 0;
+	if (strcmp(flags, "-") != 0) {
+		for (flag = strtok(flags, ","); flag != NULL; flag = strtok(NULL, ",")) {
+			if (!strcmp(flag, "erase"))
+				eeproms[index].need_erase = 1;
+			else if (!strcmp(flag, "page"))
+				eeproms[index].page_write = 1;
+			else if (!strcmp(flag, "dq5"))
+				eeproms[index].caps |= CAP_DQ5;
+			else if (!strcmp(flag, "bypass"))
+				eeproms[index].caps |= CAP_BYPASS;
+			else if (!strcmp(flag, "sdp"))
+				eeproms[index].caps |= CAP_SDP;
+			else
+				return 0;
+		}
+	}
+	/* page write loads the whole page at once, so the map of page write devices is uniform */
+	return !(eeproms[index].page_write && eeproms[index].sectors[0].count != 0);
+}
+
+/*
+ * device_file_load - add the devices described in the device file to the eeprom table
+ * Each line has the vendor and device IDs in hexadecimal format, vendor and device names,
+ * size in bytes, sector map, flags (erase, page, dq5, bypass, sdp, or "-" for none),
+ * byte program and page write times in us, sector and chip erase times in ms as
+ * typical/maximum pairs (or "-" if not used), and the software ID mode delay in us.
+ * Lines starting with ';' or '#' are comments. A device with the IDs of a built-in
+ * device replaces it.
+ */
+void device_file_load(char *device_file)
+{
+	FILE *fp;
+	char line[256], vendor[32], device[48], map[80], flags[48];
+	char byte_prog[16], page_write[16], sector_erase[16], chip_erase[16];
+	unsigned int vendor_id, device_id, loaded = 0;
+	int index;
+
+	if ((fp = fopen(device_file, "r")) == NULL) {
+		printf("ERROR: Failed to open %s for reading: %s.\n",
+		       device_file, strerror(errno));
+		exit(4);
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == ';' || line[0] == '#' || strspn(line, " \t\r\n") == strlen(line))
+			continue;
+		if (sscanf(line, "%x %x %31s %47s", &vendor_id, &device_id, vendor, device) != 4 ||
+		    vendor_id > 0xFF || device_id > 0xFF) {
+			printf("ERROR: Invalid line in %s: %s", device_file, line);
+			exit(4);
+		}
+		if ((index = eeprom_find(vendor_id, device_id)) == -1) {
+			if (num_devices == MAX_DEVICES) {
+				printf("ERROR: Too many devices in %s, the maximum is %u.\n", device_file,
+				       MAX_DEVICES - NUM_DEVICES);
+				exit(4);
+			}
+			index = num_devices;
+		}
+		if (sscanf(line, "%*x %*x %*s %*s %lu %79s %47s %15s %15s %15s %15s %u",
+			   &eeproms[index].size, map, flags, byte_prog, page_write, sector_erase,
+			   chip_erase, &eeproms[index].id_delay) != 8 ||
+		    eeproms[index].size == 0 || eeproms[index].size > 0x40000 ||
+		    !device_sectors(index, map, flags) ||
+		    !device_timing(byte_prog, &eeproms[index].byte_prog_typ, &eeproms[index].byte_prog_max) ||
+		    !device_timing(page_write, &eeproms[index].page_write_typ, &eeproms[index].page_write_max) ||
+		    !device_timing(sector_erase, &eeproms[index].sector_erase_typ,
+				   &eeproms[index].sector_erase_max) ||
+		    !device_timing(chip_erase, &eeproms[index].chip_erase_typ, &eeproms[index].chip_erase_max) ||
+		    (eeproms[index].page_write ? eeproms[index].page_write_max : eeproms[index].byte_prog_max) == 0 ||
+		    (eeproms[index].need_erase && eeproms[index].sector_erase_max == 0)) {
+			printf("ERROR: Invalid line in %s: %s", device_file, line);
+			exit(4);
+		}
+		eeproms[index].vendor_id = vendor_id;
+		eeproms[index].device_id = device_id;
+		if ((eeproms[index].vendor_name = strdup(vendor)) == NULL ||
+		    (eeproms[index].device_name = strdup(device)) == NULL) {
+			printf("ERROR: Not enough memory to load %s.\n", device_file);
+			exit(5);
+		}
+		if ((unsigned int) index == num_devices)
+			num_devices++;
+		loaded++;
+	}
+	fclose(fp);
+	printf("Loaded %u flash ROM types from %s.\n", loaded, device_file);
+}
+
+/*
+ * rom_read_id - wait for software ID mode and read vendor and device IDs
+ * Waits for the shortest ID mode delay of the known devices first. Only if
+ * a known device didn't show up yet, waits for the longest delay and reads again.
+ */
+void rom_read_id(volatile unsigned char __far *rom_start, unsigned char *vendor_id, unsigned char *device_id)
+{
+	unsigned int index, delay_min = 0xFFFF, delay_max = 0;
+
+	for (index = 0; index < num_devices; index++) {
+		if (eeproms[index].id_delay < delay_min)
+			delay_min = eeproms[index].id_delay;
+		if (eeproms[index].id_delay > delay_max)
+			delay_max = eeproms[index].id_delay;
+	}
+
+	pit_delay((unsigned int) US_TO_TICKS(delay_min) + 1);
+	*vendor_id = flash_read(rom_start);
+	*device_id = flash_read(rom_start + 1);
+
+	if (eeprom_find(*vendor_id, *device_id) == -1 && delay_max > delay_min) {
+		pit_delay((unsigned int) US_TO_TICKS(delay_max - delay_min));
+		*vendor_id = flash_read(rom_start);
+		*device_id = flash_read(rom_start + 1);
+	}
+}
+
+/* rom_identify - Identify flash ROM type, return index in eeprom table and start segment */
+int rom_identify(__segment rom_seg)
+{
+	int index = -1;
+	unsigned int i, exit_delay;
+	volatile unsigned char __far *rom_start = MK_FP(rom_seg, 0);
+	unsigned char byte0, byte1, vendor_id, device_id;
+	unsigned long start = bench_start();
+
+	byte0 = flash_read(rom_start);
+	byte1 = flash_read(rom_start + 1);
+
+	cmd_addr1 = 0x5555;
+	cmd_addr2 = 0x2AAA;
+
+	/* Enter software ID mode */
+	interrupts_disable();
+	flash_write(rom_start + cmd_addr1, 0xAA);
+	flash_write(rom_start + cmd_addr2, 0x55);
+	flash_write(rom_start + cmd_addr1, 0x90);
+	id_cmd = 0x90;
+	rom_read_id(rom_start, &vendor_id, &device_id);
+
+	if (vendor_id == byte0 && device_id == byte1) {
+		/* Try alternate software ID mode */
+		id_cmd = 0x60;
+		flash_write(rom_start + cmd_addr1, 0xAA);
+		flash_write(rom_start + cmd_addr2, 0x55);
+		flash_write(rom_start + cmd_addr1, 0x80);
+		flash_write(rom_start + cmd_addr1, 0xAA);
+		flash_write(rom_start + cmd_addr2, 0x55);
+		flash_write(rom_start + cmd_addr1, 0x60);
+		rom_read_id(rom_start, &vendor_id, &device_id);
+	}
+
+	if (vendor_id == byte0 && device_id == byte1) {
+		/* Try 0x555 and 0x2AA addresses for commands */
+		cmd_addr1 = 0x555;
+		cmd_addr2 = 0x2AA;
+
+		flash_write(rom_start + cmd_addr1, 0xAA);
+		flash_write(rom_start + cmd_addr2, 0x55);
+		flash_write(rom_start + cmd_addr1, 0x80);
+		flash_write(rom_start + cmd_addr1, 0xAA);
+		flash_write(rom_start + cmd_addr2, 0x55);
+		flash_write(rom_start + cmd_addr1, 0x60);
+		rom_read_id(rom_start, &vendor_id, &device_id);
+	}
+
+	/* Exit software ID mode */
+	flash_write(rom_start + cmd_addr1, 0xAA);
+	flash_write(rom_start + cmd_addr2, 0x55);
+	flash_write(rom_start + cmd_addr1, 0xF0);
+
+	index = eeprom_find(vendor_id, device_id);
+	if (index != -1) {
+		exit_delay = eeproms[index].id_delay;
+	} else {
+		/* unknown device, use the longest delay */
+		exit_delay = 0;
+		for (i = 0; i < num_devices; i++)
+			if (eeproms[i].id_delay > exit_delay)
+				exit_delay = eeproms[i].id_delay;
+	}
+	pit_delay((unsigned int) US_TO_TICKS(exit_delay) + 1);
+
+	interrupts_enable();
+
+	if (vendor_id == byte0 && device_id == byte1) {
+		index = -1;
+	} else if (index == -1) {
+		printf("ERROR: Unsupported flash ROM type. Vendor ID = 0x%02X; Device ID = 0x%02X\n",
+		       vendor_id, device_id);
+	}
+
+	bench_stop(BENCH_IDENTIFY, start, 0);
+	return index;
+}
+
+/*
+ * rom_poll - wait for flash ROM embedded program or erase operation to complete
+ * Uses DQ7 data# polling against the expected data, or DQ6 toggle bit if toggle
+ * is set. The PIT is only used as a watchdog, so the operation is detected as
+ * soon as it completes. On devices with CAP_DQ5 an operation that exceeded the
+ * timing limits is reported right away, and the device is reset to read mode.
+ */
+int rom_poll(volatile unsigned char __far *address, unsigned char data, unsigned long timeout,
+	     unsigned char toggle, unsigned int caps)
+{
+	unsigned char status, previous;
+
+	previous = flash_read(address);
+	pit_start(timeout);
+	do {
+		status = flash_read(address);
+		if (toggle ? !((status ^ previous) & 0x40) : !((status ^ data) & 0x80)) {
+			/* DQ6 stopped toggling or DQ7 matches data - operation completed */
+			return (flash_read(address) == data) ? POLL_DONE : POLL_FAILED;
+		}
+		if ((caps & CAP_DQ5) && (status & 0x20)) {
+			/* DQ5 set - check once more, the operation might have just completed */
+			previous = flash_read(address);
+			status = flash_read(address);
+			if (toggle ? !((status ^ previous) & 0x40) : !((status ^ data) & 0x80))
+				return (flash_read(address) == data) ? POLL_DONE : POLL_FAILED;
+			flash_write(address, 0xF0);	/* reset the device to read array mode */
+			return POLL_FAILED;
+		}
+		previous = status;
+	} while (!pit_expired());
+
+	return POLL_TIMEOUT;
+}
+
+/* rom_erase_start - start page erase operation, use rom_erase_wait() for completion */
+void rom_erase_start(__segment rom_seg, __segment page_seg)
+{
+	volatile unsigned char __far *rom_start = MK_FP(rom_seg, 0);
+	volatile unsigned char __far *rom_address = MK_FP(page_seg, 0);
+
+	rom_modified = 1;
+	/* Enter page erase mode */
+	command_begin();
+	flash_write(rom_start + cmd_addr1, 0xAA);
+	flash_write(rom_start + cmd_addr2, 0x55);
+	flash_write(rom_start + cmd_addr1, 0x80);
+	flash_write(rom_start + cmd_addr1, 0xAA);
+	flash_write(rom_start + cmd_addr2, 0x55);
+	flash_write(rom_address, 0x30);
+	command_end();
+}
+
+int rom_erase_wait(__segment page_seg, unsigned int eeprom_index)
+{
+	volatile unsigned char __far *rom_address = MK_FP(page_seg, 0);
+
+	/* poll EPROM - wait for erase operation to complete */
+	return rom_poll(rom_address, 0xFF, MS_TO_TICKS(eeproms[eeprom_index].sector_erase_max), 1,
+			eeproms[eeprom_index].caps);
+}
+
+int rom_erase_chip(__segment rom_seg, unsigned int eeprom_index)
+{
+	volatile unsigned char __far *rom_start = MK_FP(rom_seg, 0);
+
+	rom_modified = 1;
+	/* Enter chip erase mode */
+	command_begin();
+	flash_write(rom_start + cmd_addr1, 0xAA);
+	flash_write(rom_start + cmd_addr2, 0x55);
+	flash_write(rom_start + cmd_addr1, 0x80);
+	flash_write(rom_start + cmd_addr1, 0xAA);
+	flash_write(rom_start + cmd_addr2, 0x55);
+	flash_write(rom_start + cmd_addr1, 0x10);
+	command_end();
+
+	/* poll EPROM - wait for erase operation to complete */
+	return rom_poll(rom_start, 0xFF, MS_TO_TICKS(eeproms[eeprom_index].chip_erase_max), 1,
+			eeproms[eeprom_index].caps);
+}
+
+/*
+ * rom_sdp_disable - disable software data protection of a page write device
+ * While it is disabled, pages are written by loading the data without the command
+ * sequence. Use rom_sdp_enable() to protect the device again, page_seg is the page
+ * it writes if no page is written before.
+ */
+void rom_sdp_disable(__segment rom_seg, __segment page_seg, unsigned int page_size, unsigned int eeprom_index)
+{
+	volatile unsigned char __far *rom_start = MK_FP(rom_seg, 0);
+
+	command_begin();
+	flash_write(rom_start + cmd_addr1, 0xAA);
+	flash_write(rom_start + cmd_addr2, 0x55);
+	flash_write(rom_start + cmd_addr1, 0x80);
+	flash_write(rom_start + cmd_addr1, 0xAA);
+	flash_write(rom_start + cmd_addr2, 0x55);
+	flash_write(rom_start + cmd_addr1, 0x20);
+	command_end();
+	/* the device is busy for the write cycle time */
+	pit_delay((unsigned int) US_TO_TICKS(eeproms[eeprom_index].page_write_max));
+
+	chips[chip_current].sdp_page = page_seg;
+	chips[chip_current].sdp_page_size = page_size;
+	chips[chip_current].sdp_disabled = 1;
+}
+
+int rom_program_page(__segment rom_seg, __segment page_seg, __segment file_seg, unsigned int page_size, unsigned int eeprom_index)
+{
+	unsigned int offset;
+	unsigned long timeout = US_TO_TICKS(eeproms[eeprom_index].byte_prog_max);
+	int status;
+	volatile unsigned char __far *rom_start = MK_FP(rom_seg, 0);
+	volatile unsigned char __far *rom_address = MK_FP(page_seg, 0);
+	unsigned char __far *file_address = MK_FP(file_seg, 0);
+
+	rom_modified = 1;
+	if (eeproms[eeprom_index].page_write) {
+		if (chips[chip_current].sdp_disabled) {
+			chips[chip_current].sdp_page = page_seg;
+			chips[chip_current].sdp_page_size = page_size;
+		}
+		command_begin();
+		if (!chips[chip_current].sdp_disabled) {
+			/* Enter page write mode, this also enables software data protection */
+			flash_write(rom_start + cmd_addr1, 0xAA);
+			flash_write(rom_start + cmd_addr2, 0x55);
+			flash_write(rom_start + cmd_addr1, 0xA0);
+		}
+
+		/*
+		 * write page - the bytes must be loaded within the byte load cycle time
+		 * of each other, use a single string instruction to load them back to back
+		 */
+#ifdef USE_ASM
+		__asm {
+			push	ds
+			push	es
+			push	si
+			push	di
+			push	cx
+			push	ax
+			mov	cx,page_size
+			mov	ax,page_seg
+			mov	es,ax
+			mov	ax,file_seg
+			mov	ds,ax
+			xor	si,si
+			xor	di,di
+			cld
+			rep	movsb
+			pop	ax
+			pop	cx
+			pop	di
+			pop	si
+			pop	es
+			pop	ds
+		}
+#else
+		for (offset = 0; offset < page_size; offset++)
+			flash_write(rom_address + offset, file_address[offset]);
+#endif
+		command_end();
+
+		/* poll EPROM - wait for write operation to complete */
+		return rom_poll(rom_address + page_size - 1, file_address[page_size - 1],
+				US_TO_TICKS(eeproms[eeprom_index].page_write_max), 0,
+				eeproms[eeprom_index].caps);
+	} else {
+		offset = 0;
+		if ((eeproms[eeprom_index].caps & CAP_BYPASS) && !bypass_failed) {
+			/* Enter unlock bypass mode */
+			command_begin();
+			flash_write(rom_start + cmd_addr1, 0xAA);
+			flash_write(rom_start + cmd_addr2, 0x55);
+			flash_write(rom_start + cmd_addr1, 0x20);
+			command_end();
+
+			for (; offset < page_size; offset++) {
+				/* write byte using two cycle unlock bypass program command */
+				command_begin();
+				flash_write(rom_address + offset, 0xA0);
+				flash_write(rom_address + offset, file_address[offset]);
+				command_end();
+
+				/* poll EPROM - wait for write operation to complete */
+				status = rom_poll(rom_address + offset, file_address[offset],
+						  timeout, 0, eeproms[eeprom_index].caps);
+				if (status != POLL_DONE)
+					break;
+			}
+
+			/* Exit unlock bypass mode */
+			command_begin();
+			flash_write(rom_address, 0x90);
+			flash_write(rom_address, 0x00);
+			command_end();
+
+			if (offset == page_size)
+				return POLL_DONE;
+
+			/*
+			 * Byte didn't program in unlock bypass mode, the device might not support it.
+			 * Retry the rest of the page with the regular program command, and
+			 * if that works, don't use unlock bypass anymore.
+			 */
+			bypass_failed = 1;
+		}
+		for (; offset < page_size; offset++) {
+			/* Enter write mode */
+			command_begin();
+			flash_write(rom_start + cmd_addr1, 0xAA);
+			flash_write(rom_start + cmd_addr2, 0x55);
+			flash_write(rom_start + cmd_addr1, 0xA0);
+
+			/* write byte */
+			flash_write(rom_address + offset, file_address[offset]);
+			command_end();
+
+			/* poll EPROM - wait for write operation to complete */
+			status = rom_poll(rom_address + offset, file_address[offset],
+					  timeout, 0, eeproms[eeprom_index].caps);
+			if (status != POLL_DONE)
+				return status;
+		}
+	}
+
+	return POLL_DONE;
+}
+
+/*
+ * rom_sdp_enable - enable software data protection of the chips disabled by rom_sdp_disable()
+ * The command sequence takes effect only with the page write that follows it, so the
+ * last page written to each chip is written again with its current content and read back.
+ * Returns the number of chips that are not protected again.
+ */
+unsigned int rom_sdp_enable()
+{
+	unsigned int chip, size, failed = 0;
+	__segment page_seg;
+
+	for (chip = 0; chip < num_chips; chip++) {
+		if (!chips[chip].sdp_disabled)
+			continue;
+		chip_select(chip);
+		chips[chip].sdp_disabled = 0;
+		page_seg = chips[chip].sdp_page;
+		size = chips[chip].sdp_page_size;
+		_fmemcpy(MK_FP(sdp_seg, 0), MK_FP(page_seg, 0), size);
+		if (rom_program_page(chips[chip].rom_start, page_seg, sdp_seg, size,
+				     chips[chip].eeprom_index) != POLL_DONE ||
+		    mem_match(page_seg, sdp_seg, 0, size) != size)
+			failed++;
+	}
+	return failed;
+}
+
+/*
+ * backup_init - prepare to save up to max_pages pages, max_bytes in total, of the flash ROM
+ * The pages are saved to the journal file if it is specified, to XMS or EMS memory otherwise.
+ * If conventional is set, they are saved to conventional memory, which can be read
+ * with the interrupts masked. max_page_size is the largest page size of the chips.
+ * Returns non-zero if there is not enough memory for the backup.
+ */
+int backup_init(unsigned int max_pages, unsigned long max_bytes, unsigned int max_page_size,
+		int conventional)
+{
+	struct saved_page *list;
+	void __huge *buf;
+
+	if ((list = malloc(max_pages * sizeof(struct saved_page))) == NULL)
+		return 1;
+	if ((backup_buf_seg = seg_alloc(max_page_size, &buf)) == 0 ||
+	    (conventional && (backup_seg = seg_alloc(max_bytes, &backup_mem)) == 0) ||
+	    (!conventional && journal_file == NULL && ext_alloc(&backup, max_bytes) != 0)) {
+		if (backup_buf_seg != 0)
+			hfree(buf);
+		free(list);
+		return 1;
+	}
+	if (!conventional && journal_file != NULL &&
+	    _dos_creat(journal_file, _A_NORMAL, &backup_handle) != 0) {
+		printf("ERROR: Failed to create %s: %s.\n",
+		       journal_file, strerror(errno));
+		exit(2);
+	}
+	backup_list = list;
+	backup_pages = 0;
+	backup_size = 0;
+	return 0;
+}
+
+/*
+ * backup_page - save the page of page_size bytes at page_seg of the selected chip
+ * Each journal file record is the page segment and size, 16-bit little endian,
+ * followed by the page content.
+ */
+void backup_page(__segment page_seg, unsigned int page_size)
+{
+	struct saved_page *saved = &backup_list[backup_pages];
+	unsigned char header[4];
+
+	saved->seg = page_seg;
+	saved->size = page_size;
+	saved->chip = chip_current;
+	if (backup_handle != -1) {
+		saved->pos = backup_size + (unsigned long) (backup_pages + 1) * 4;
+		header[0] = page_seg;
+		header[1] = page_seg >> 8;
+		header[2] = page_size;
+		header[3] = page_size >> 8;
+		file_write_buf(backup_handle, journal_file, header, 4);
+		file_write(backup_handle, journal_file, page_seg, page_size);
+	} else if (backup_seg != 0) {
+		saved->pos = backup_size;
+		_fmemcpy(MK_FP(backup_seg + (unsigned int) (saved->pos >> 4), 0), MK_FP(page_seg, 0), page_size);
+	} else {
+		saved->pos = backup_size;
+		ext_store(&backup, saved->pos, page_seg, page_size);
+	}
+	backup_size += page_size;
+	backup_pages++;
+}
+
+/* backup_load - load the saved page number page into buf_seg:0, return non-zero on errors */
+int backup_load(unsigned int page, __segment buf_seg)
+{
+	struct saved_page *saved = &backup_list[page];
+
+	if (backup_handle != -1) {
+		lseek(backup_handle, saved->pos, SEEK_SET);
+		return file_fetch(backup_handle, journal_file, buf_seg, saved->size);
+	}
+	if (backup_seg != 0) {
+		_fmemcpy(MK_FP(buf_seg, 0), MK_FP(backup_seg + (unsigned int) (saved->pos >> 4), 0), saved->size);
+		return 0;
+	}
+	return ext_move(&backup, saved->pos, buf_seg, saved->size, 0);
+}
+
+/* backup_name - return the name of the backup location for the messages */
+char *backup_name()
+{
+	static char name[16];
+
+	if (backup_handle != -1)
+		return journal_file;
+	sprintf(name, "%s memory", ext_names[backup_seg != 0 ? EXT_NONE : ext_kind]);
+	return name;
+}
+
+/* backup_discard - delete the journal file, the saved pages are no longer needed */
+void backup_discard()
+{
+	if (backup_handle == -1)
+		return;
+	_dos_close(backup_handle);
+	backup_handle = -1;
+	remove(journal_file);
+}
+
+/*
+ * rom_restore - program the saved pages that changed with their original content
+ * Called with the interrupts held after a failure, returns the number of pages
+ * that couldn't be restored.
+ */
+unsigned int rom_restore()
+{
+	unsigned int page, attempt, failed = 0;
+	unsigned int page_size, eeprom_index;
+	int status;
+	__segment rom_start, page_seg, buf_seg = backup_buf_seg;
+
+	for (page = 0; page < backup_pages; page++) {
+		page_seg = backup_list[page].seg;
+		page_size = backup_list[page].size;
+		chip_select(backup_list[page].chip);
+		rom_start = chips[chip_current].rom_start;
+		eeprom_index = chips[chip_current].eeprom_index;
+		if (backup_seg != 0) {
+			status = backup_load(page, buf_seg);
+		} else {
+			/* DOS and XMS or EMS drivers need interrupts to read the backup, the chip runs no code */
+			interrupts_release();
+			status = backup_load(page, buf_seg);
+			interrupts_hold();
+		}
+		if (status != 0) {
+			failed++;
+			continue;
+		}
+		for (attempt = 0; mem_match(page_seg, buf_seg, 0, page_size) != page_size; attempt++) {
+			if (attempt > retries) {
+				failed++;
+				break;
+			}
+			status = POLL_DONE;
+			if (eeproms[eeprom_index].need_erase && !rom_blank(page_seg, page_size)) {
+				rom_erase_start(rom_start, page_seg);
+				status = rom_erase_wait(page_seg, eeprom_index);
+			}
+			if (status == POLL_DONE)
+				rom_program_page(rom_start, page_seg, buf_seg, page_size, eeprom_index);
+		}
+	}
+	return failed;
+}
+
+/* rom_failure - restore the saved pages if any, report flash ROM operation failure and exit */
+void rom_failure(char *operation, __segment page_seg, int status, int exit_code)
+{
+	unsigned int failed = 0, sdp_failed;
+
+	if (backup_list != NULL)
+		failed = rom_restore();
+	sdp_failed = rom_sdp_enable();
+	interrupts_release();
+	irq_scoped = 0;
+	printf("\nERROR: Failed to %s flash ROM at 0x%04X:0000: %s.\n", operation, page_seg,
+	       status == POLL_TIMEOUT ? "operation timed out" :
+	       status == POLL_MISMATCH ? "data doesn't match the image" :
+	       status == POLL_READ ? read_error : "device reported an error");
+	if (!rom_modified) {
+		printf("The flash ROM content has not been changed.\n");
+		backup_discard();
+	} else if (backup_list != NULL && failed == 0) {
+		printf("The original flash ROM content has been restored from the backup.\n");
+		backup_discard();
+	} else {
+		if (backup_list != NULL)
+			printf("Failed to restore %u of %u saved pages.\n", failed, backup_pages);
+		printf("The flash ROM content is likely corrupted. Do not reboot the system!\n");
+	}
+	if (sdp_failed != 0)
+		printf("WARNING: Failed to enable software data protection of the flash ROM.\n");
+	exit(exit_code);
+}
+
+/*
+ * rom_update_page - erase (if requested), program, and optionally verify a page
+ * Failed pages are erased and programmed again up to the number of retries,
+ * exits with an error if the page still fails. Returns the number of retries used.
+ * Software data protection of the chip is disabled before its first page is written,
+ * rom_sdp_enable() enables it again.
+ * If read_ahead is set, the next ahead_size bytes of that image are read while the page is erased.
+ */
+unsigned int rom_update_page(__segment rom_start, __segment page_seg, __segment file_seg,
+			     unsigned int page_size, unsigned int eeprom_index, int erase,
+			     unsigned char __far *progress, struct image *read_ahead,
+			     unsigned int ahead_size)
+{
+	unsigned int attempt;
+	int status, ahead_status = 0;
+	unsigned long start;
+
+	/* from the first write on, write the pages of the chip without the command sequences */
+	if ((eeproms[eeprom_index].caps & CAP_SDP) && !chips[chip_current].sdp_disabled)
+		rom_sdp_disable(rom_start, page_seg, page_size, eeprom_index);
+
+	/* a blank page can be programmed without erasing it */
+	if (erase && rom_blank(page_seg, page_size)) {
+		erase = 0;
+		blank_skipped++;
+	}
+
+	for (attempt = 0; ; attempt++) {
+		if (erase || (attempt > 0 && eeproms[eeprom_index].need_erase)) {
+			video_write_char(progress, 'E', 0x07);
+			start = bench_start();
+			rom_erase_start(rom_start, page_seg);
+			if (read_ahead != NULL && attempt == 0 && read_ahead->serial) {
+				ahead_status = image_prefetch(read_ahead, ahead_size);
+			} else if (read_ahead != NULL && attempt == 0) {
+				/* DOS needs interrupts to read the file */
+				interrupts_release();
+				ahead_status = image_prefetch(read_ahead, ahead_size);
+				interrupts_hold();
+			}
+			status = rom_erase_wait(page_seg, eeprom_index);
+			bench_stop(BENCH_ERASE, start, page_size);
+			/* the next page can't be read, restore this one now that the chip is idle */
+			if (ahead_status != 0)
+				rom_failure("program", page_seg, POLL_READ, 6);
+			if (status != POLL_DONE) {
+				if (attempt < retries)
+					continue;
+				rom_failure("erase", page_seg, status, 11);
+			}
+		}
+		video_write_char(progress, 'P', 0x07);
+		start = bench_start();
+		status = rom_program_page(rom_start, page_seg, file_seg, page_size, eeprom_index);
+		bench_stop(BENCH_PROGRAM, start, page_size);
+		if (status == POLL_DONE && (options & OPT_VERIFY)) {
+			video_write_char(progress, 'V', 0x07);
+			start = bench_start();
+			if (mem_match(page_seg, file_seg, 0, page_size) != page_size)
+				status = POLL_MISMATCH;
+			bench_stop(BENCH_VERIFY, start, page_size);
+		}
+		if (status == POLL_DONE)
+			break;
+		if (attempt == retries)
+			rom_failure(status == POLL_MISMATCH ? "verify" : "program", page_seg, status, 12);
+	}
+	video_write_char(progress, 0xDB, 0x07);
+
+	return attempt;
+}
+
+/*
+ * rom_identify_quick - check that the cached device is at rom_seg, return its eeprom table index
+ * Uses a single software ID mode entry with the cached command and addresses.
+ * Returns -1 if the device doesn't match the cache.
+ */
+int rom_identify_quick(__segment rom_seg)
+{
+	int index;
+	volatile unsigned char __far *rom_start = MK_FP(rom_seg, 0);
+	unsigned char byte0, byte1, vendor_id, device_id;
+
+	if ((index = eeprom_find(id_cache.vendor_id, id_cache.device_id)) == -1)
+		return -1;
+
+	byte0 = flash_read(rom_start);
+	byte1 = flash_read(rom_start + 1);
+	cmd_addr1 = id_cache.cmd_addr1;
+	cmd_addr2 = id_cache.cmd_addr2;
+
+	interrupts_disable();
+	flash_write(rom_start + cmd_addr1, 0xAA);
+	flash_write(rom_start + cmd_addr2, 0x55);
+	if (id_cache.id_cmd == 0x60) {
+		flash_write(rom_start + cmd_addr1, 0x80);
+		flash_write(rom_start + cmd_addr1, 0xAA);
+		flash_write(rom_start + cmd_addr2, 0x55);
+	}
+	flash_write(rom_start + cmd_addr1, id_cache.id_cmd);
+	pit_delay((unsigned int) US_TO_TICKS(eeproms[index].id_delay) + 1);
+	vendor_id = flash_read(rom_start);
+	device_id = flash_read(rom_start + 1);
+
+	/* Exit software ID mode */
+	flash_write(rom_start + cmd_addr1, 0xAA);
+	flash_write(rom_start + cmd_addr2, 0x55);
+	flash_write(rom_start + cmd_addr1, 0xF0);
+	pit_delay((unsigned int) US_TO_TICKS(eeproms[index].id_delay) + 1);
+	interrupts_enable();
+
+	/* the ID doesn't count if it could be the ROM content */
+	if (vendor_id != id_cache.vendor_id || device_id != id_cache.device_id ||
+	    (vendor_id == byte0 && device_id == byte1))
+		return -1;
+	id_cmd = id_cache.id_cmd;
+	return index;
+}
+
+/* id_cache_load - read the flash ROM identity cache file, return non-zero on success */
+int id_cache_load(char *cache_file)
+{
+	int handle;
+	char text[64];
+	unsigned int count;
+
+	if (_dos_open(cache_file, O_RDONLY, &handle) != 0)
+		return 0;
+	if (_dos_read(handle, text, sizeof(text) - 1, &count) != 0)
+		count = 0;
+	_dos_close(handle);
+	text[count] = '\0';
+	return sscanf(text, "%x %x %x %x %x %x", &id_cache.vendor_id, &id_cache.device_id,
+		      &id_cache.rom_start, &id_cache.cmd_addr1, &id_cache.cmd_addr2, &id_cache.id_cmd) == 6;
+}
+
+/* id_cache_save - save the detected flash ROM identity to the cache file */
+void id_cache_save(char *cache_file, __segment rom_start, unsigned int eeprom_index)
+{
+	int handle;
+	char text[64];
+	unsigned int size, count;
+
+	if (_dos_creat(cache_file, _A_NORMAL, &handle) != 0) {
+		printf("WARNING: Failed to create %s: %s.\n", cache_file, strerror(errno));
+		return;
+	}
+	size = sprintf(text, "%02X %02X %04X %04X %04X %02X\r\n", eeproms[eeprom_index].vendor_id,
+		       eeproms[eeprom_index].device_id, rom_start, cmd_addr1, cmd_addr2, id_cmd);
+	if (_dos_write(handle, text, size, &count) != 0 || count != size)
+		printf("WARNING: Failed to write %s: %s.\n", cache_file, strerror(errno));
+	_dos_close(handle);
+}
+
+/* rom_detect - identify the flash ROM containing rom_seg, return its eeprom table index and start segment */
+unsigned int rom_detect(__segment rom_seg, __segment *rom_start_ptr)
+{
+	int eeprom_index, chip;
+	__segment rom_start;
+
+	/* the flash ROM in the same area has been identified already */
+	if ((chip = chip_find(rom_seg)) != -1) {
+		chip_select(chip);
+		*rom_start_ptr = chips[chip].rom_start;
+		return chips[chip].eeprom_index;
+	}
+	if (num_chips == MAX_CHIPS) {
+		printf("ERROR: Too many flash ROM chips, the maximum is %u.\n", MAX_CHIPS);
+		exit(10);
+	}
+
+	if (id_override) {
+		/* the device type is specified with -t option, use the default command addresses */
+		if ((eeprom_index = eeprom_find(id_cache.vendor_id, id_cache.device_id)) == -1)
+			error("Unsupported flash ROM type specified with -t option.");
+		rom_start = (rom_seg < 0xE000) ? rom_seg : 0xF000;
+		cmd_addr1 = 0x5555;
+		cmd_addr2 = 0x2AAA;
+	} else if (id_cache_file != NULL && id_cache_load(id_cache_file) &&
+		   (rom_seg < 0xE000 ? id_cache.rom_start == rom_seg : id_cache.rom_start >= 0xE000) &&
+		   (eeprom_index = rom_identify_quick(id_cache.rom_start)) != -1) {
+		/* the cached device is still there, no need to probe */
+		rom_start = id_cache.rom_start;
+	} else if (rom_seg < 0xE000) {
+		/* if not flashing system ROM BIOS area, assume that the ROM starts at the ROM segment */
+		rom_start = rom_seg;
+		if ((eeprom_index = rom_identify(rom_start)) == -1) {
+			error("Cannot detect flash ROM type.\nMake sure that flash ROM is not write protected.");
+		}
+	} else {
+		/* for system ROM BIOS - try 0xF000 first */
+		rom_start = 0xF000;
+		if ((eeprom_index = rom_identify(rom_start)) == -1) {
+			/* try 0xE000 */
+			rom_start = 0xE000;
+			if ((eeprom_index = rom_identify(rom_start)) == -1) {
+				error("Cannot detect flash ROM type.\nOn Sergey's XT Version 1.0 systems make sure that SW2.6 - SW2.7 are OFF.");
+			}
+		}
+	}
+
+	printf("Detected flash ROM at 0x%04X, type: %s %s, %spage size: %u bytes.\n",
+		rom_start, eeproms[eeprom_index].vendor_name, eeproms[eeprom_index].device_name,
+		eeproms[eeprom_index].sectors[0].count != 0 ? "non-uniform sectors, largest " : "",
+		eeproms[eeprom_index].page_size);
+
+	if (id_cache_file != NULL && !id_override)
+		id_cache_save(id_cache_file, rom_start, eeprom_index);
+
+	chips[num_chips].window = (rom_seg < 0xE000) ? rom_seg : 0xE000;
+	chips[num_chips].rom_start = rom_start;
+	chips[num_chips].eeprom_index = eeprom_index;
+	chips[num_chips].cmd_addr1 = cmd_addr1;
+	chips[num_chips].cmd_addr2 = cmd_addr2;
+	chip_current = num_chips++;
+	*rom_start_ptr = rom_start;
+	return eeprom_index;
+}
+
+/* rom_chip_seg - return the first segment of the device detected at rom_start */
+__segment rom_chip_seg(__segment rom_start, unsigned int eeprom_index)
+{
+	/* the devices in the system ROM BIOS area end at 0xFFFFF, other devices start at rom_start */
+	if (rom_start >= 0xE000)
+		return 0x10000 - (eeproms[eeprom_index].size >> 4);
+	return rom_start;
+}
+
+/*
+ * rom_page - return the size of the flash ROM page (sector) containing seg, and its
+ * first segment in *page_start. chip_seg is the first segment of the device. The
+ * segments outside of a non-uniform sector map are treated as uniform pages.
+ */
+unsigned int rom_page(unsigned int eeprom_index, __segment chip_seg, __segment seg,
+		      __segment *page_start)
+{
+	unsigned int run, paragraphs;
+	unsigned long offset, run_paragraphs;
+
+	if (seg >= chip_seg) {
+		offset = seg - chip_seg;
+		for (run = 0; run < MAX_SECTOR_RUNS && eeproms[eeprom_index].sectors[run].count != 0; run++) {
+			paragraphs = eeproms[eeprom_index].sectors[run].size >> 4;
+			run_paragraphs = (unsigned long) eeproms[eeprom_index].sectors[run].count * paragraphs;
+			if (offset < run_paragraphs) {
+				*page_start = seg - (unsigned int) (offset % paragraphs);
+				return eeproms[eeprom_index].sectors[run].size;
+			}
+			offset -= run_paragraphs;
+		}
+	}
+	paragraphs = eeproms[eeprom_index].page_size >> 4;
+	*page_start = seg - seg % paragraphs;
+	return eeproms[eeprom_index].page_size;
+}
+
+/* rom_page_size - return the size of the flash ROM page starting at page_seg */
+unsigned int rom_page_size(unsigned int eeprom_index, __segment chip_seg, __segment page_seg)
+{
+	__segment page_start;
+
+	return rom_page(eeprom_index, chip_seg, page_seg, &page_start);
+}
+
+/*
+ * rom_pages - return the number of flash ROM pages covering size bytes from the page at
+ * page_seg, and the total size of these pages in *covered
+ */
+unsigned int rom_pages(unsigned int eeprom_index, __segment chip_seg, __segment page_seg,
+		       unsigned long size, unsigned long *covered)
+{
+	unsigned int num_pages = 0, page_size;
+
+	for (*covered = 0; *covered < size; num_pages++) {
+		page_size = rom_page_size(eeprom_index, chip_seg, page_seg);
+		*covered += page_size;
+		page_seg += page_size >> 4;
+	}
+	return num_pages;
+}
+
+/* verify_range - report a range of the differing bytes found by rom_verify() */
+void verify_range(unsigned long addr, unsigned long size, unsigned char rom_data,
+		  unsigned char file_data)
+{
+	unsigned long last = addr + size - 1;
+
+	/* the addresses are shown relative to the 64 KiB segments */
+	if (size == 1)
+		printf("WARNING: Difference found at 0x%04X:%04X: ROM = 0x%02X; file 0x%02X\n",
+		       (unsigned int) (addr >> 4) & 0xF000, (unsigned int) (addr & 0xFFFF), rom_data, file_data);
+	else
+		printf("WARNING: Differences found at 0x%04X:%04X-0x%04X:%04X, %lu bytes\n",
+		       (unsigned int) (addr >> 4) & 0xF000, (unsigned int) (addr & 0xFFFF),
+		       (unsigned int) (last >> 4) & 0xF000, (unsigned int) (last & 0xFFFF), size);
+}
+
+/*
+ * rom_verify - compare the flash ROM content with the image
+ * Consecutive differing bytes are reported as one range, and verify stops after
+ * max_diffs ranges if it is set. The differing bytes are also counted per flash ROM
+ * page if the flash ROM type is known, per VERIFY_BLOCK otherwise.
+ * Returns the number of differing bytes found.
+ */
+unsigned long rom_verify(__segment rom_seg, struct image *image, unsigned long rom_size)
+{
+	unsigned long bytes_to_verify, addr, diff = 0, range_addr = 0, range_size = 0, page_end, covered;
+	unsigned int chunk_size, verify_size, offset, count, part, ranges = 0, page = 0, page_size;
+	unsigned int num_pages, *page_diffs;
+	unsigned char rom_data = 0, file_data = 0;
+	int eeprom_index = -1, stopped = 0;
+	__segment file_seg, rom_start, chip_seg = 0, first_seg, page_seg;
+	unsigned long start = bench_start();
+
+	/* the page sizes are used if the flash ROM was identified already, it is not probed here */
+	if (id_override || chip_find(rom_seg) != -1) {
+		eeprom_index = rom_detect(rom_seg, &rom_start);
+		chip_seg = rom_chip_seg(rom_start, eeprom_index);
+		page_size = rom_page(eeprom_index, chip_seg, rom_seg, &page_seg);
+		num_pages = rom_pages(eeprom_index, chip_seg, page_seg,
+				      ((unsigned long) (rom_seg - page_seg) << 4) + rom_size, &covered);
+	} else {
+		page_size = VERIFY_BLOCK;
+		page_seg = rom_seg - rom_seg % (VERIFY_BLOCK >> 4);
+		num_pages = (((unsigned long) (rom_seg - page_seg) << 4) + rom_size + VERIFY_BLOCK - 1) /
+			    VERIFY_BLOCK;
+	}
+	first_seg = page_seg;
+	page_end = ((unsigned long) page_seg << 4) + page_size;
+	page_diffs = calloc(num_pages, sizeof(unsigned int));
+
+	/* verify up to 32 KiB at a time, streamed images in smaller chunks */
+	chunk_size = image_streamed(image) ? STREAM_CHUNK : 0x8000;
+	bytes_to_verify = rom_size;
+	while (bytes_to_verify > 0 && !stopped) {
+		if (bytes_to_verify > chunk_size) {
+			verify_size = chunk_size;
+		} else {
+			verify_size = bytes_to_verify;
+		}
+		file_seg = image_next(image, verify_size);
+		/* a range that reached the end of the previous chunk ends there, unless this one continues it */
+		if (range_size != 0 && mem_match(rom_seg, file_seg, 0, 1) == 1) {
+			verify_range(range_addr, range_size, rom_data, file_data);
+			range_size = 0;
+			if (++ranges == max_diffs) {
+				stopped = 1;
+				break;
+			}
+		}
+		offset = 0;
+		while ((offset += mem_match(rom_seg, file_seg, offset, verify_size - offset)) < verify_size) {
+			count = mem_differ(rom_seg, file_seg, offset, verify_size - offset);
+			addr = ((unsigned long) rom_seg << 4) + offset;
+			diff += count;
+
+			/* a range that ended at the end of the previous chunk continues in this one */
+			if (range_size != 0 && range_addr + range_size == addr) {
+				range_size += count;
+			} else {
+				range_addr = addr;
+				range_size = count;
+				rom_data = ((unsigned char __far *)MK_FP(rom_seg, 0))[offset];
+				file_data = ((unsigned char __far *)MK_FP(file_seg, 0))[offset];
+			}
+			offset += count;
+
+			/* count the differing bytes in each page they are in */
+			for (; page_diffs != NULL && count > 0; count -= part) {
+				while (addr >= page_end) {
+					page_seg += page_size >> 4;
+					page_size = eeprom_index != -1 ?
+						    rom_page_size(eeprom_index, chip_seg, page_seg) : VERIFY_BLOCK;
+					page_end += page_size;
+					page++;
+				}
+				part = (page_end - addr < count) ? (unsigned int) (page_end - addr) : count;
+				page_diffs[page] += part;
+				addr += part;
+			}
+
+			/* the range is complete unless it reaches the end of the chunk */
+			if (offset < verify_size) {
+				verify_range(range_addr, range_size, rom_data, file_data);
+				range_size = 0;
+				if (++ranges == max_diffs) {
+					stopped = 1;
+					break;
+				}
+			}
+		}
+		/* advance ROM address by incrementing the segment */
+		rom_seg += verify_size >> 4;
+		bytes_to_verify -= verify_size;
+	}
+	if (range_size != 0) {
+		verify_range(range_addr, range_size, rom_data, file_data);
+		ranges++;
+	}
+	/* the rest of a serial image isn't needed */
+	if (stopped && image->serial)
+		xmodem_abort();
+
+	bench_stop(BENCH_VERIFY, start, rom_size - bytes_to_verify);
+
+	if (diff > 0) {
+		printf("WARNING: %lu differences found in %u ranges%s\n", diff, ranges,
+		       stopped ? ", verify stopped" : "");
+		page_seg = first_seg;
+		for (page = 0; page_diffs != NULL && page < num_pages; page++) {
+			page_size = eeprom_index != -1 ?
+				    rom_page_size(eeprom_index, chip_seg, page_seg) : VERIFY_BLOCK;
+			if (page_diffs[page] != 0)
+				printf("%s at 0x%04X:0000, size %u bytes: %u differences\n",
+				       eeprom_index != -1 ? "Page" : "Block", page_seg, page_size,
+				       page_diffs[page]);
+			page_seg += page_size >> 4;
+		}
+	} else {
+		printf("No differences found\n");
+	}
+	if (page_diffs != NULL)
+		free(page_diffs);
+	return diff;
+}
+
+/*
+ * manifest_image - load the regions from first to last, all in one flash ROM chip, as one image
+ * The gaps between the regions are filled with the current ROM content.
+ */
+void manifest_image(struct image *image, char *manifest, struct region *regions, unsigned int first,
+		    unsigned int last)
+{
+	unsigned int i, copy_size;
+	unsigned long bytes_to_copy, region_pos;
+	__segment region_seg, data_seg, buf_seg = 0;
+	void __huge *buf = NULL;
+	int handle;
+
+	image->name = manifest;
+	image->handle = -1;
+	image->compressed = 0;
+	image->extended = 0;
+	image->serial = 0;
+	image->pos = 0;
+	image->next_buf = NULL;
+	image->ahead = 0;
+	image->buf_size = 0;
+	image->size = ((unsigned long) (regions[last].seg - regions[first].seg) << 4) +
+		      regions[last].size;
+	/* XMS or EMS memory is used only if the regions don't fit in conventional memory, as in image_open() */
+	if ((image->seg = seg_alloc(image->size, &image->buf)) == 0) {
+		if (!(options & OPT_EXT) || ext_alloc(&image->ext, image->size) != 0) {
+			printf("ERROR: Not enough memory to load %lu bytes.\n", image->size);
+			exit(5);
+		}
+		/* the files are read to XMS or EMS memory through a small buffer */
+		printf("Loading the regions to %s memory.\n", ext_names[ext_kind]);
+		if ((buf_seg = seg_alloc(STREAM_CHUNK, &buf)) == 0) {
+			printf("ERROR: Failed to allocate %u bytes for input buffer.\n", STREAM_CHUNK);
+			exit(5);
+		}
+		image->extended = 1;
+		image->ext_pos = 0;
+	}
+
+	/* start with the current ROM content, and load the files on top of it */
+	data_seg = image->seg;
+	region_seg = regions[first].seg;
+	for (bytes_to_copy = image->size; bytes_to_copy > 0; bytes_to_copy -= copy_size) {
+		if (bytes_to_copy > 0x8000) {
+			copy_size = 0x8000;
+		} else {
+			copy_size = bytes_to_copy;
+		}
+		if (image->extended)
+			ext_store(&image->ext, image->size - bytes_to_copy, region_seg, copy_size);
+		else
+			_fmemcpy(MK_FP(data_seg, 0), MK_FP(region_seg, 0), copy_size);
+		data_seg += 0x0800;
+		region_seg += 0x0800;
+	}
+	for (i = first; i <= last; i++) {
+		if (_dos_open(regions[i].name, O_RDONLY, &handle) != 0) {
+			printf("ERROR: Failed to open %s for reading: %s.\n",
+			       regions[i].name, strerror(errno));
+			exit(4);
+		}
+		if (image->extended) {
+			region_pos = (unsigned long) (regions[i].seg - regions[first].seg) << 4;
+			for (bytes_to_copy = regions[i].size; bytes_to_copy > 0; bytes_to_copy -= copy_size) {
+				copy_size = (bytes_to_copy > STREAM_CHUNK) ? STREAM_CHUNK : bytes_to_copy;
+				file_read(handle, regions[i].name, buf_seg, copy_size);
+				ext_store(&image->ext, region_pos, buf_seg, copy_size);
+				region_pos += copy_size;
+			}
+		} else {
+			region_seg = image->seg + (regions[i].seg - regions[first].seg);
+			file_read(handle, regions[i].name, region_seg, regions[i].size);
+		}
+		_dos_close(handle);
+	}
+	if (image->extended)
+		hfree(buf);
+}
 
-	printf("Loading flash ROM image from %s, size %lu bytes.\n",
-		in_file, *rom_size);
+/*
+ * manifest_load - load the regions listed in the layout manifest, one image per flash ROM chip
+ * Each line of the manifest has the segment address in hexadecimal format and the
+ * file name, lines starting with ';' or '#' are comments. The regions must not
+ * overlap. The regions can be in several flash ROM chips, for example an option ROM
+ * flash and the system BIOS flash, each chip is identified once. The gaps between the
+ * regions in the same chip are filled with the current ROM content, so each chip can
+ * be programmed in one pass. Returns the number of targets (chips).
+ */
+unsigned int manifest_load(struct target *targets, char *manifest)
+{
+	FILE *fp;
+	char line[128];
+	static struct region regions[MAX_REGIONS];	/* too large for the stack */
+	struct region temp;
+	unsigned int i, j, num_regions = 0, eeprom_index, first = 0, num_targets = 0, seg;
+	unsigned long chip_end = 0;
+	__segment rom_start, chip_seg = 0;
+	struct stat st;
 
-	if ((fp_in = fopen(in_file, "rb")) == NULL) {
+	if ((fp = fopen(manifest, "r")) == NULL) {
 		printf("ERROR: Failed to open %s for reading: %s.\n",
-		       in_file, strerror(errno));
+		       manifest, strerror(errno));
 		exit(4);
 	}
-	
-	if ((buf_addr = (unsigned long) halloc (*rom_size, 1)) == 0x0) {
-		printf("ERROR: Failed to allocate %lu bytes for input buffer.\n",
-		       *rom_size);
-		exit(5);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == ';' || line[0] == '#' || strspn(line, " \t\r\n") == strlen(line))
+			continue;
+		if (num_regions == MAX_REGIONS) {
+			printf("ERROR: Too many regions in %s, the maximum is %u.\n", manifest, MAX_REGIONS);
+			exit(4);
+		}
+		if (sscanf(line, "%x %79s", &seg, regions[num_regions].name) != 2 || seg < 0xC000 ||
+		    seg > 0xFFFF) {
+			printf("ERROR: Invalid line in %s: %s", manifest, line);
+			exit(4);
+		}
+		regions[num_regions].seg = seg;
+		if (stat(regions[num_regions].name, &st) == -1) {
+			printf("ERROR: Failed to stat %s: %s.\n",
+				regions[num_regions].name, strerror(errno));
+			exit(4);
+		}
+		regions[num_regions].size = st.st_size;
+		/* check if the region extends beyond 1 MiB */
+		if (regions[num_regions].size == 0 ||
+		    ((unsigned long) regions[num_regions].seg << 4) + regions[num_regions].size > 0x100000) {
+			printf("ERROR: Region 0x%04X:0000 of %s is empty or extends beyond 1 MiB.\n",
+			       regions[num_regions].seg, regions[num_regions].name);
+			exit(4);
+		}
+		num_regions++;
+	}
+	fclose(fp);
+	if (num_regions == 0) {
+		printf("ERROR: No regions found in %s.\n", manifest);
+		exit(4);
 	}
-	/* calculate the segment and the offset of the buffer */
-	file_segment = buf_addr >> 16;
-	if ((buf_addr & 0xFFFF) != 0) {
-		printf("ERROR: halloc() returned address with non-zero offset: 0x%08lX\n, buf_addr");
-		exit(5);
 
+	/* sort the regions by address */
+	for (i = 1; i < num_regions; i++) {
+		temp = regions[i];
+		for (j = i; j > 0 && regions[j - 1].seg > temp.seg; j--)
+			regions[j] = regions[j - 1];
+		regions[j] = temp;
 	}
 
-	bytes_to_read = *rom_size;
-	read_segment = file_segment;
-	while (bytes_to_read > 0) {
-		/* read up to 32 KiB at a time */
-		if (bytes_to_read > 0x8000) {
-			read_size = 0x8000;
-		} else {
-			read_size = bytes_to_read;
+	for (i = 0; i < num_regions; i++) {
+		if (i > 0 && ((unsigned long) regions[i - 1].seg << 4) + regions[i - 1].size >
+			     ((unsigned long) regions[i].seg << 4)) {
+			printf("ERROR: Regions 0x%04X:0000 and 0x%04X:0000 overlap.\n",
+			       regions[i - 1].seg, regions[i].seg);
+			exit(10);
 		}
-		if ((count = fread(read_segment:>0, 1, read_size, fp_in)) != read_size) {
-			printf("ERROR: Short read while reading %s. Read %u bytes, expected to read %u bytes.\n",
-			       in_file, count, read_size);
-			exit(6);
-		}
-		/* advance read address by 32 KiB by incrementing the segment */
-		read_segment += 0x0800;
-		bytes_to_read -= read_size;
-	}
-	fclose(fp_in);
-	return file_segment;
-}
-	               
-unsigned int checksum (__segment data_seg, unsigned long rom_size)
-{
-	unsigned int checksum_size, checksum = 0;
-	unsigned long bytes_to_checksum = rom_size, offset;
-	while (bytes_to_checksum > 0) {
-		if (bytes_to_checksum > 0x8000) {
-			checksum_size = 0x8000;
-		} else {
-			checksum_size = bytes_to_checksum;
+		/* identify each flash ROM once, a region after the end of the current one starts the next target */
+		if (num_targets == 0 || ((unsigned long) regions[i].seg << 4) >= chip_end) {
+			if (num_targets > 0)
+				manifest_image(&targets[num_targets - 1].image, manifest, regions, first, i - 1);
+			eeprom_index = rom_detect(regions[i].seg, &rom_start);
+			chip_seg = rom_chip_seg(rom_start, eeprom_index);
+			chip_end = ((unsigned long) chip_seg << 4) + eeproms[eeprom_index].size;
+			/* only a part of an option ROM flash is mapped, the system ROM BIOS area is another chip */
+			if (rom_start < 0xE000 && chip_end > 0xE0000)
+				chip_end = 0xE0000;
+			targets[num_targets].seg = regions[i].seg;
+			targets[num_targets].chip = chip_current;
+			num_targets++;
+			first = i;
 		}
-		for (offset = 0; offset < checksum_size; offset++) {
-			checksum += ((unsigned char __far *) data_seg:>0)[offset];
+		printf("Region 0x%04X:0000, size %lu bytes: %s\n", regions[i].seg, regions[i].size,
+		       regions[i].name);
+		if (regions[i].seg < chip_seg ||
+		    ((unsigned long) regions[i].seg << 4) + regions[i].size > chip_end) {
+			printf("ERROR: Region 0x%04X:0000 is outside of the detected flash ROM.\n",
+			       regions[i].seg);
+			exit(10);
 		}
-		/* advance checksum address by 32 KiB by incrementing the segment */
-		data_seg += 0x0800;
-		bytes_to_checksum -= checksum_size;
 	}
-	return checksum;
+
+	manifest_image(&targets[num_targets - 1].image, manifest, regions, first, num_regions - 1);
+	return num_targets;
 }
 
-/* rom_identify - Identify flash ROM type, return index in eeprom table and start segment */
-int rom_identify(__segment rom_seg)
+/* rom_check_pages - check that the range covers whole flash pages, return the number of pages */
+unsigned int rom_check_pages(__segment rom_seg, unsigned long rom_size, unsigned int eeprom_index,
+			     __segment chip_seg)
 {
-	int index = -1;
-	volatile unsigned char __far *rom_start = rom_seg:>0;
-	unsigned char byte0, byte1, vendor_id, device_id;
+	unsigned int num_pages;
+	unsigned long covered;
+	__segment page_start;
 
-	byte0 = rom_start[0];
-	byte1 = rom_start[1];
-
-	cmd_addr1 = 0x5555;
-	cmd_addr2 = 0x2AAA;
-
-	/* Enter software ID mode */
-	interrupts_disable();
-	rom_start[cmd_addr1] = 0xAA;
-	rom_start[cmd_addr2] = 0x55;
-	rom_start[cmd_addr1] = 0x90;
-	pit_delay(IDENTIFY_DELAY);
+	rom_page(eeprom_index, chip_seg, rom_seg, &page_start);
+	if (page_start != rom_seg) {
+		printf("ERROR: Specified ROM segment (0x%04X) doesn't start on the page boundary.\n",
+			rom_seg);
+		exit(10);
+	}
+	num_pages = rom_pages(eeprom_index, chip_seg, rom_seg, rom_size, &covered);
+	if (covered != rom_size) {
+		printf("ERROR: Size (%lu) is is not a multiply of the flash page size.\n", rom_size);
+		exit(10);
+	}
+	return num_pages;
+}
 
-	vendor_id = rom_start[0];
-	device_id = rom_start[1];
+/*
+ * rom_map - print CRC-32 of each flash ROM page, using the detected device geometry
+ * The map is computed for the image if specified, otherwise for the current ROM content.
+ * It is written to out_file if specified, otherwise to the standard output.
+ */
+void rom_map(__segment rom_seg, struct image *image, unsigned long rom_size, char *out_file)
+{
+	unsigned int eeprom_index, page, page_size, num_pages;
+	__segment rom_start, chip_seg, data_seg;
+	unsigned long crc;
+	FILE *fp = stdout;
 
-	if (vendor_id == byte0 && device_id == byte1) {
-		/* Try alternate software ID mode */
-		rom_start[cmd_addr1] = 0xAA;
-		rom_start[cmd_addr2] = 0x55;
-		rom_start[cmd_addr1] = 0x80;
-		rom_start[cmd_addr1] = 0xAA;
-		rom_start[cmd_addr2] = 0x55;
-		rom_start[cmd_addr1] = 0x60;
-		pit_delay(IDENTIFY_DELAY);
+	eeprom_index = rom_detect(rom_seg, &rom_start);
+	chip_seg = rom_chip_seg(rom_start, eeprom_index);
+	num_pages = rom_check_pages(rom_seg, rom_size, eeprom_index, chip_seg);
 
-		vendor_id = rom_start[0];
-		device_id = rom_start[1];
+	if (out_file != NULL) {
+		printf("Saving sector map of %s to %s.\n", image != NULL ? image->name : "the flash ROM",
+		       out_file);
+		if ((fp = fopen(out_file, "w")) == NULL) {
+			printf("ERROR: Failed to create %s: %s.\n",
+			       out_file, strerror(errno));
+			exit(2);
+		}
 	}
 
-	if (vendor_id == byte0 && device_id == byte1) {
-		/* Try 0x555 and 0x2AA addresses for commands */
-		cmd_addr1 = 0x555;
-		cmd_addr2 = 0x2AA;
-
-		rom_start[cmd_addr1] = 0xAA;
-		rom_start[cmd_addr2] = 0x55;
-		rom_start[cmd_addr1] = 0x80;
-		rom_start[cmd_addr1] = 0xAA;
-		rom_start[cmd_addr2] = 0x55;
-		rom_start[cmd_addr1] = 0x60;
-		pit_delay(IDENTIFY_DELAY);
-
-		vendor_id = rom_start[0];
-		device_id = rom_start[1];
+	crc32_init();
+	fprintf(fp, "; %s %s, %lu bytes at 0x%04X:0000, %spage size %u bytes\n",
+		eeproms[eeprom_index].vendor_name, eeproms[eeprom_index].device_name,
+		rom_size, rom_seg,
+		eeproms[eeprom_index].sectors[0].count != 0 ? "non-uniform sectors, largest " : "",
+		eeproms[eeprom_index].page_size);
+	for (page = 0; page < num_pages; page++) {
+		page_size = rom_page_size(eeprom_index, chip_seg, rom_seg);
+		if (image != NULL)
+			data_seg = image_next(image, page_size);
+		else
+			data_seg = rom_seg;
+		crc = crc32_update(0xFFFFFFFF, data_seg, page_size) ^ 0xFFFFFFFF;
+		fprintf(fp, "%04X %08lX\n", rom_seg, crc);
+		rom_seg += page_size >> 4;
 	}
 
-	/* Exit software ID mode */
-	rom_start[cmd_addr1] = 0xAA;
-	rom_start[cmd_addr2] = 0x55;
-	rom_start[cmd_addr1] = 0xF0;
-	pit_delay(IDENTIFY_DELAY);
+	if (out_file != NULL)
+		fclose(fp);
+}
 
-	interrupts_enable();
+/*
+ * image_page - return the segment of the image data for the flash ROM page at page_seg
+ * The pages partially covered by the image are merged with their current content
+ * in the merge buffer. head is the number of bytes before the image in its first page.
+ * Returns 0 and sets read_error if the image can't be read.
+ */
+__segment image_page(struct image *image, __segment page_seg, unsigned int page_size,
+		     unsigned int head, __segment merge_seg)
+{
+	unsigned int start, count;
+	unsigned long remaining = image->size - image->pos;
+	__segment file_seg;
 
-	if (vendor_id == byte0 && device_id == byte1) {
-		index = -1;
-	} else {
-		for (index = 0; index < NUM_DEVICES; index++)
-			if (eeproms[index].vendor_id == vendor_id && eeproms[index].device_id == device_id)
-				break;
-		if (NUM_DEVICES == index) {
-			printf("ERROR: Unsupported flash ROM type. Vendor ID = 0x%02X; Device ID = 0x%02X\n",
-			       vendor_id, device_id);
-			index = -1;
-		}
-	}
+	start = (image->pos == 0) ? head : 0;
+	if (start == 0 && remaining >= page_size)
+		return image_fetch(image, page_size);
 
-	return index;
+	count = page_size - start;
+	if (count > remaining)
+		count = remaining;
+	_fmemcpy(MK_FP(merge_seg, 0), MK_FP(page_seg, 0), page_size);
+	if ((file_seg = image_fetch(image, count)) == 0)
+		return 0;
+	_fmemcpy(MK_FP(merge_seg, start), MK_FP(file_seg, 0), count);
+	return merge_seg;
 }
 
-int rom_erase_page(__segment rom_seg, __segment page_seg)
+/* rom_blank_check - report blank (erased) and non-blank flash ROM pages */
+void rom_blank_check(__segment rom_seg, unsigned long rom_size)
 {
-	unsigned int timeout;
-	volatile unsigned char __far *rom_start = rom_seg:>0;
-	volatile unsigned char __far *rom_address = page_seg:>0;
+	unsigned int eeprom_index, page, page_size, num_pages, blank = 0;
+	__segment rom_start, chip_seg;
 
-	/* Enter page erase mode */
-	rom_start[cmd_addr1] = 0xAA;
-	rom_start[cmd_addr2] = 0x55;
-	rom_start[cmd_addr1] = 0x80;
-	rom_start[cmd_addr1] = 0xAA;
-	rom_start[cmd_addr2] = 0x55;
-	rom_address[0] = 0x30;
+	eeprom_index = rom_detect(rom_seg, &rom_start);
+	chip_seg = rom_chip_seg(rom_start, eeprom_index);
+	num_pages = rom_check_pages(rom_seg, rom_size, eeprom_index, chip_seg);
 
-	/* poll EPROM - wait for erase operation to complete */
-	for (timeout = 0; timeout < ERASE_TIMEOUT; timeout++) {
-		if (rom_address[0] == 0xFF)
-			return 0;
-		pit_delay(WRITE_DELAY);
+	for (page = 0; page < num_pages; page++) {
+		page_size = rom_page_size(eeprom_index, chip_seg, rom_seg);
+		if (rom_blank(rom_seg, page_size)) {
+			printf("Page at 0x%04X:0000 is blank\n", rom_seg);
+			blank++;
+		} else {
+			printf("Page at 0x%04X:0000 is not blank\n", rom_seg);
+		}
+		rom_seg += page_size >> 4;
 	}
-
-	return 1;
+	printf("%u blank pages, %u pages not blank.\n", blank, num_pages - blank);
 }
 
-int rom_program_page(__segment rom_seg, __segment page_seg, __segment file_seg, unsigned int page_size, unsigned char page_write)
+/*
+ * rom_erase - erase the flash ROM pages, skipping the pages that are blank already
+ * With -C option the entire flash ROM is erased using chip erase.
+ */
+void rom_erase(__segment rom_seg, unsigned long rom_size)
 {
-	unsigned int offset, timeout;
-	volatile unsigned char __far *rom_start = rom_seg:>0;
-	volatile unsigned char __far *rom_address = page_seg:>0;
-	unsigned char __far *file_address = file_seg:>0;
-
-	if (page_write) {
-		/* Enter page write mode */
-		rom_start[cmd_addr1] = 0xAA;
-		rom_start[cmd_addr2] = 0x55;
-		rom_start[cmd_addr1] = 0xA0;
-
-		/* write page */
-		for (offset = 0; offset < page_size; offset++)
-			rom_address[offset] = file_address[offset];
+	unsigned int eeprom_index, page, page_size, num_pages, attempt, erased = 0;
+	__segment rom_start, chip_seg;
+	int status;
+	unsigned long start;
 
-		/* poll EPROM - wait for write operation to complete */
-		for (timeout = 0; timeout < PAGE_WRITE_TIMEOUT; timeout++) {
-			if (rom_address[page_size - 1] == file_address[page_size - 1])
-				return 0;
-			pit_delay(WRITE_DELAY);
-		}
-	} else {
-		for (offset = 0; offset < page_size; offset++) {
-			/* Enter write mode */
-			rom_start[cmd_addr1] = 0xAA;
-			rom_start[cmd_addr2] = 0x55;
-			rom_start[cmd_addr1] = 0xA0;
+	eeprom_index = rom_detect(rom_seg, &rom_start);
+	chip_seg = rom_chip_seg(rom_start, eeprom_index);
+	num_pages = rom_check_pages(rom_seg, rom_size, eeprom_index, chip_seg);
+	if (!eeproms[eeprom_index].need_erase) {
+		printf("The detected flash ROM doesn't need erasing, pages are erased when programmed.\n");
+		return;
+	}
+	irq_scoped = !rom_chip_in_use(chip_seg, eeproms[eeprom_index].size);
 
-			/* write byte */
-			rom_address[offset] = file_address[offset];
+	if (options & OPT_CHIP_ERASE) {
+		if (eeproms[eeprom_index].chip_erase_max == 0)
+			error("Chip erase is not supported by the detected flash ROM.");
+		printf("Erasing the entire flash ROM at 0x%04X:0000, size %lu bytes.\n", chip_seg,
+		       eeproms[eeprom_index].size);
+		printf("Please wait. Do not reboot the system!\n");
+		interrupts_hold();
+		start = bench_start();
+		status = rom_erase_chip(rom_start, eeprom_index);
+		bench_stop(BENCH_CHIP_ERASE, start, eeproms[eeprom_index].size);
+		if (status != POLL_DONE)
+			rom_failure("erase", chip_seg, status, 11);
+		interrupts_release();
+		irq_scoped = 0;
+		printf("Flash ROM has been erased successfully.\n");
+		return;
+	}
 
-			/* verify byte */
-			for (timeout = 0; timeout < BYTE_WRITE_TIMEOUT; timeout++) {
-				if (rom_address[offset] == file_address[offset])
+	printf("Erasing %lu bytes of the flash ROM starting at address 0x%04X:0000.\n", rom_size, rom_seg);
+	printf("Please wait. Do not reboot the system!\n");
+	interrupts_hold();
+	for (page = 0; page < num_pages; page++) {
+		outp(0x80, page);
+		page_size = rom_page_size(eeprom_index, chip_seg, rom_seg);
+		if (rom_blank(rom_seg, page_size)) {
+			blank_skipped++;
+		} else {
+			for (attempt = 0; ; attempt++) {
+				start = bench_start();
+				rom_erase_start(rom_start, rom_seg);
+				status = rom_erase_wait(rom_seg, eeprom_index);
+				bench_stop(BENCH_ERASE, start, page_size);
+				if (status == POLL_DONE)
 					break;
-				pit_delay(WRITE_DELAY);
+				if (attempt == retries)
+					rom_failure("erase", rom_seg, status, 11);
 			}
-			if (timeout == BYTE_WRITE_TIMEOUT)
-				break;
+			erased++;
 		}
-		if (offset == page_size)
-			return 0;
+		rom_seg += page_size >> 4;
 	}
-
-	return 1;
+	interrupts_release();
+	irq_scoped = 0;
+	printf("%u pages erased, %u blank pages skipped.\n", erased, blank_skipped);
 }
 
-void rom_program(__segment rom_seg, __segment file_seg, unsigned long rom_size)
+void rom_program(__segment rom_seg, struct image *image, unsigned long rom_size)
 {
 	unsigned int eeprom_index;
-	__segment rom_start;
-	unsigned int page, page_size, num_pages, page_paragraph, pages_per_column = 1;
-	unsigned char __far *video_address;
+	__segment rom_start, image_seg = rom_seg;
+	unsigned int page, page_size, num_pages, chip_pages;
+	unsigned int dirty, skipped = 0, retried = 0, head, chip_idle, io_in_use;
+	unsigned int sdp_failed;
+	int status, chip_erase;
+	struct image *read_ahead = NULL;
+	__segment chip_seg, page_seg, file_seg, merge_seg = 0;
+	void __huge *merge_buf = NULL;
+	unsigned long start, covered, chip_size, done = 0;
 
-	if (rom_seg < 0xE000) {
-		/* if not flashing system ROM BIOS area, assume that the ROM starts at the ROM segment */
-		rom_start = rom_seg;
-		if ((eeprom_index = rom_identify(rom_start)) == -1) {
-			error("Cannot detect flash ROM type.\nMake sure that flash ROM is not write protected.");
+	eeprom_index = rom_detect(rom_seg, &rom_start);
+	chip_seg = rom_chip_seg(rom_start, eeprom_index);
+
+	/*
+	 * The pages partially covered by the image are programmed with the image data
+	 * merged with the current content of the rest of the page.
+	 */
+	rom_page(eeprom_index, chip_seg, rom_seg, &page_seg);
+	head = (rom_seg - page_seg) << 4;
+	rom_seg = page_seg;
+	num_pages = rom_pages(eeprom_index, chip_seg, rom_seg, head + rom_size, &covered);
+	if (head != 0 || covered != head + rom_size) {
+		printf("Image doesn't start or end on the page boundary, merging it with the current ROM content.\n");
+		if ((merge_seg = seg_alloc(eeproms[eeprom_index].page_size, &merge_buf)) == 0) {
+			printf("ERROR: Failed to allocate %u bytes for page buffer.\n",
+			       eeproms[eeprom_index].page_size);
+			exit(5);
 		}
-	} else {
-		/* for system ROM BIOS - try 0xF000 first */
-		rom_start = 0xF000;
-		if ((eeprom_index = rom_identify(rom_start)) == -1) {
-			/* try 0xE000 */
-			rom_start = 0xE000;
-			if ((eeprom_index = rom_identify(rom_start)) == -1) {
-				error("Cannot detect flash ROM type.\nOn Sergey's XT Version 1.0 systems make sure that SW2.6 - SW2.7 are OFF.");
+	}
+	/* a page is written again to enable software data protection when done */
+	if ((eeproms[eeprom_index].caps & CAP_SDP) &&
+	    (sdp_seg = seg_alloc(eeproms[eeprom_index].page_size, &sdp_buf)) == 0) {
+		printf("ERROR: Failed to allocate %u bytes for page buffer.\n", eeproms[eeprom_index].page_size);
+		exit(5);
+	}
+
+	/*
+	 * When the image covers the entire device, use chip erase if it is expected
+	 * to be faster than erasing the changed pages one by one.
+	 */
+	chip_erase = 0;
+	if (options & OPT_CHIP_ERASE) {
+		if (eeproms[eeprom_index].chip_erase_max == 0)
+			error("Chip erase is not supported by the detected flash ROM.");
+		if (rom_seg != chip_seg || rom_size < eeproms[eeprom_index].size)
+			printf("WARNING: Chip erase will erase the flash ROM outside of the programmed area.\n");
+		chip_erase = 1;
+	} else if (eeproms[eeprom_index].need_erase && rom_seg == chip_seg &&
+		   rom_size >= eeproms[eeprom_index].size) {
+		/* count the pages that need to be programmed, the image received over serial is read once */
+		dirty = num_pages;
+		if (!(options & OPT_FULL_PROG) && !image->serial) {
+			page_seg = rom_seg;
+			for (page = 0; page < num_pages; page++) {
+				page_size = rom_page_size(eeprom_index, chip_seg, page_seg);
+				if ((file_seg = image_page(image, page_seg, page_size, head, merge_seg)) == 0)
+					read_failed();
+				if (_fmemcmp(MK_FP(page_seg, 0), MK_FP(file_seg, 0), page_size) == 0)
+					dirty--;
+				page_seg += page_size >> 4;
 			}
+			image_rewind(image);
 		}
+		if ((unsigned long) dirty * eeproms[eeprom_index].sector_erase_typ >
+		    eeproms[eeprom_index].chip_erase_typ)
+			chip_erase = 1;
 	}
 
-	printf("Detected flash ROM at 0x%04X, type: %s %s, page size: %u bytes.\n",
-		rom_start, eeproms[eeprom_index].vendor_name, eeproms[eeprom_index].device_name,
-		eeproms[eeprom_index].page_size);
-
-	page_size = eeproms[eeprom_index].page_size;
-	/* check that requested ROM segment is on the page boundary */
-	page_paragraph = page_size >> 4;
-	if ((rom_seg / page_paragraph) * page_paragraph != rom_seg) {
-		printf("ERROR: Specified ROM segment (0x%04X) doesn't start on the page boundary.\n",
-			rom_seg);
+	/* the image can be streamed only if disk I/O doesn't need the code that is being modified */
+	io_in_use = chip_erase ? rom_range_in_use(chip_seg, eeproms[eeprom_index].size) :
+				 rom_range_in_use(rom_seg, covered);
+	if (image_streamed(image) && !image->serial && io_in_use) {
+		printf("ERROR: Disk I/O interrupt handlers are located in the programmed area.\n");
+		if (image->extended)
+			printf("The image can't be read from %s memory, free up conventional memory to load it.\n",
+			       ext_names[ext_kind]);
+		else
+			printf("The image can't be read page by page, free up memory to load it.\n");
+		exit(9);
 	}
 
-	/* figure out number of pages to program */
-	num_pages = rom_size / page_size;
-	if ((unsigned long) num_pages * page_size != rom_size) {
-		printf("ERROR: ROM image size (%lu) is is not a multiply of the flash page size.\n",
-			rom_size);
-		exit(10);
+	/*
+	 * read the next page from the file while erasing, if nothing runs from the chip;
+	 * serial port is polled with the interrupts disabled, so it can always be read ahead
+	 */
+	chip_idle = !rom_chip_in_use(chip_seg, eeproms[eeprom_index].size);
+	if (image_streamed(image) && eeproms[eeprom_index].need_erase && !chip_erase &&
+	    (chip_idle || image->serial))
+		read_ahead = image;
+
+	/*
+	 * save the pages that will be erased or programmed, to restore them if programming fails;
+	 * chip erase erases all pages, otherwise only the pages that differ from the image change.
+	 * DOS and XMS or EMS drivers need interrupts to read them back, so the pages of a chip
+	 * that runs code are saved to conventional memory.
+	 */
+	if (journal_file != NULL || ((options & OPT_EXT) && ext_kind != EXT_NONE)) {
+		if (!chip_idle)
+			printf("The system runs code from the programmed chip, saving its content to conventional memory.\n");
+		chip_pages = rom_pages(eeprom_index, chip_seg, chip_seg, eeproms[eeprom_index].size,
+				       &chip_size);
+		if (chip_erase ?
+		    backup_init(chip_pages, chip_size, eeproms[eeprom_index].page_size, !chip_idle) :
+		    backup_init(num_pages, covered, eeproms[eeprom_index].page_size, !chip_idle)) {
+			printf("WARNING: Not enough memory to save the flash ROM content.\n");
+		} else if (chip_erase) {
+			page_seg = chip_seg;
+			for (page = 0; page < chip_pages; page++) {
+				page_size = rom_page_size(eeprom_index, chip_seg, page_seg);
+				if (!rom_blank(page_seg, page_size))
+					backup_page(page_seg, page_size);
+				page_seg += page_size >> 4;
+			}
+		} else if (image->serial) {
+			/* can't compare with the image before receiving it, save all programmed pages */
+			page_seg = rom_seg;
+			for (page = 0; page < num_pages; page++) {
+				page_size = rom_page_size(eeprom_index, chip_seg, page_seg);
+				if (!rom_blank(page_seg, page_size))
+					backup_page(page_seg, page_size);
+				page_seg += page_size >> 4;
+			}
+		} else {
+			page_seg = rom_seg;
+			for (page = 0; page < num_pages; page++) {
+				page_size = rom_page_size(eeprom_index, chip_seg, page_seg);
+				if ((file_seg = image_page(image, page_seg, page_size, head, merge_seg)) == 0)
+					read_failed();
+				if ((options & OPT_FULL_PROG) || _fmemcmp(MK_FP(page_seg, 0), MK_FP(file_seg, 0), page_size) != 0)
+					backup_page(page_seg, page_size);
+				page_seg += page_size >> 4;
+			}
+			image_rewind(image);
+		}
+		if (backup_list != NULL)
+			printf("Saved %u pages (%lu bytes) of the flash ROM content to %s.\n", backup_pages,
+			       backup_size, backup_name());
 	}
 
-	printf("Programming the flash ROM with %lu bytes starting at address 0x%04X:0000.\n", rom_size, rom_seg);
+	printf("Programming the flash ROM with %lu bytes starting at address 0x%04X:0000.\n", rom_size, image_seg);
 	printf("Please wait. Do not reboot the system!\n");
-	video_address = get_video_address();
-	if (num_pages > 40) {
-		pages_per_column = num_pages / 32;
-	}
-	for (page = 0; page < num_pages; page++) {
-		video_write_char(video_address + (page / pages_per_column) * 2, 0xB0, 0x07);
+	/* BIOS teletype output can be used if the video BIOS doesn't run from the chip */
+	progress_init(num_pages, covered, chip_idle);
+	irq_scoped = chip_idle;
+	interrupts_hold();
+
+	if (chip_erase) {
+		for (page = 0; page < num_pages; page++)
+			video_write_char(progress_page(page), 'E', 0x07);
+		start = bench_start();
+		status = rom_erase_chip(rom_start, eeprom_index);
+		bench_stop(BENCH_CHIP_ERASE, start, eeproms[eeprom_index].size);
+		if (status != POLL_DONE)
+			rom_failure("erase", chip_seg, status, 11);
 	}
-	interrupts_disable();
 
 	for (page = 0; page < num_pages; page++) {
 		outp(0x80, page);
-		if (eeproms[eeprom_index].need_erase) {
-			video_write_char(video_address + (page / pages_per_column) * 2, 'E', 0x07);
-			rom_erase_page(rom_start, rom_seg);
-			/* note: not checking the exit code, will try to program the flash ROM anyway */
-		}
-		video_write_char(video_address + (page / pages_per_column) * 2, 'P', 0x07);
-		rom_program_page(rom_start, rom_seg, file_seg, page_size, eeproms[eeprom_index].page_write);
-		video_write_char(video_address + (page / pages_per_column) * 2, 0xDB, 0x07);
+		page_size = rom_page_size(eeprom_index, chip_seg, rom_seg);
+		if (image_streamed(image) && !image->serial) {
+			/* DOS and XMS or EMS drivers need interrupts to read the image */
+			interrupts_release();
+			file_seg = image_page(image, rom_seg, page_size, head, merge_seg);
+			interrupts_hold();
+		} else {
+			file_seg = image_page(image, rom_seg, page_size, head, merge_seg);
+		}
+		if (file_seg == 0)
+			rom_failure("program", rom_seg, POLL_READ, 6);
+		/*
+		 * after chip erase only the pages that are not blank in the image need programming,
+		 * blank pages of the devices that erase the page as they write it don't need it either
+		 */
+		if (((chip_erase || !(options & OPT_FULL_PROG)) &&
+		     _fmemcmp(MK_FP(rom_seg, 0), MK_FP(file_seg, 0), page_size) == 0) ||
+		    (eeproms[eeprom_index].page_write && rom_blank(file_seg, page_size) &&
+		     rom_blank(rom_seg, page_size))) {
+			/* page already contains the image data, no need to erase and program it */
+			video_write_char(progress_page(page), 0xB2, 0x07);
+			skipped++;
+		} else {
+			retried += rom_update_page(rom_start, rom_seg, file_seg, page_size, eeprom_index,
+						   eeproms[eeprom_index].need_erase && !chip_erase,
+						   progress_page(page), read_ahead,
+						   rom_page_size(eeprom_index, chip_seg, rom_seg + (page_size >> 4)));
+		}
 		rom_seg += page_size >> 4;
-		file_seg += page_size >> 4;
+		done += page_size;
+		progress_update(done, page + 1 == num_pages);
 	}
 
-	interrupts_enable();
+	sdp_failed = rom_sdp_enable();
+	interrupts_release();
+	irq_scoped = 0;
+	if (merge_buf != NULL)
+		hfree(merge_buf);
+	if (sdp_seg != 0)
+		hfree(sdp_buf);
+	backup_discard();
+	if (sdp_failed != 0)
+		printf("WARNING: Failed to enable software data protection of the flash ROM.\n");
+	printf("\n%u pages programmed%s, %u unchanged pages skipped, %u blank pages not erased, %u retries.\n",
+	       num_pages - skipped, (options & OPT_VERIFY) ? " and verified" : "", skipped,
+	       blank_skipped, retried);
+	printf("Flash ROM has been programmed successfully. Please reboot the system.\n");
+}
+
+/*
+ * rom_program_chips - program the manifest targets in several flash ROM chips together
+ * In each round the next changed page of every chip is read, the page erases are started
+ * on all chips, and then each page is programmed as soon as its erase completes, so a chip
+ * is programmed while the erase of the next chips is still running. Chip erase is not used.
+ */
+void rom_program_chips(struct target *targets, unsigned int num_targets)
+{
+	struct target *target;
+	unsigned int t, eeprom_index, page_size, max_page_size = 0, sdp_page_size = 0, total_pages = 0;
+	unsigned int busy, skipped = 0, retried = 0, chips_idle = 1, io_in_use = 0, streamed = 0, sdp_failed;
+	int status, erase;
+	__segment rom_start, chip_seg, page_seg, file_seg;
+	unsigned long covered, total = 0, done = 0;
+
+	if (options & OPT_CHIP_ERASE)
+		error("Chip erase can't be used with the regions in several flash ROM chips.");
+
+	for (t = 0; t < num_targets; t++) {
+		target = &targets[t];
+		eeprom_index = chips[target->chip].eeprom_index;
+		chip_seg = rom_chip_seg(chips[target->chip].rom_start, eeprom_index);
+		rom_page(eeprom_index, chip_seg, target->seg, &target->page_seg);
+		target->head = (target->seg - target->page_seg) << 4;
+		target->num_pages = rom_pages(eeprom_index, chip_seg, target->page_seg,
+					      target->head + target->image.size, &covered);
+		target->page = 0;
+		target->first_page = total_pages;
+		target->merge_seg = 0;
+		target->merge_buf = NULL;
+		if (target->head != 0 || covered != target->head + target->image.size) {
+			printf("Region 0x%04X:0000 doesn't start or end on the page boundary, merging it with the current ROM content.\n",
+			       target->seg);
+			if ((target->merge_seg = seg_alloc(eeproms[eeprom_index].page_size, &target->merge_buf)) == 0) {
+				printf("ERROR: Failed to allocate %u bytes for page buffer.\n",
+				       eeproms[eeprom_index].page_size);
+				exit(5);
+			}
+		}
+		if (eeproms[eeprom_index].page_size > max_page_size)
+			max_page_size = eeproms[eeprom_index].page_size;
+		if ((eeproms[eeprom_index].caps & CAP_SDP) && eeproms[eeprom_index].page_size > sdp_page_size)
+			sdp_page_size = eeproms[eeprom_index].page_size;
+		if (rom_chip_in_use(chip_seg, eeproms[eeprom_index].size))
+			chips_idle = 0;
+		if (rom_range_in_use(target->page_seg, covered))
+			io_in_use = 1;
+		if (image_streamed(&target->image))
+			streamed = 1;
+		total_pages += target->num_pages;
+		total += covered;
+		image_rewind(&target->image);
+	}
+	if (streamed && io_in_use) {
+		printf("ERROR: Disk I/O interrupt handlers are located in the programmed area.\n");
+		printf("The regions can't be read from %s memory, free up conventional memory to load them.\n",
+		       ext_names[ext_kind]);
+		exit(9);
+	}
+	/* a page of each chip is written again to enable software data protection when done */
+	if (sdp_page_size != 0 && (sdp_seg = seg_alloc(sdp_page_size, &sdp_buf)) == 0) {
+		printf("ERROR: Failed to allocate %u bytes for page buffer.\n", sdp_page_size);
+		exit(5);
+	}
+
+	/* save the pages that differ from the images, to restore them if programming fails */
+	if (journal_file != NULL || ((options & OPT_EXT) && ext_kind != EXT_NONE)) {
+		if (!chips_idle)
+			printf("The system runs code from the programmed chips, saving their content to conventional memory.\n");
+		if (backup_init(total_pages, total, max_page_size, !chips_idle)) {
+			printf("WARNING: Not enough memory to save the flash ROM content.\n");
+		} else {
+			for (t = 0; t < num_targets; t++) {
+				target = &targets[t];
+				chip_select(target->chip);
+				eeprom_index = chips[target->chip].eeprom_index;
+				chip_seg = rom_chip_seg(chips[target->chip].rom_start, eeprom_index);
+				page_seg = target->page_seg;
+				for (target->page = 0; target->page < target->num_pages; target->page++) {
+					page_size = rom_page_size(eeprom_index, chip_seg, page_seg);
+					if ((file_seg = image_page(&target->image, page_seg, page_size, target->head,
+								   target->merge_seg)) == 0)
+						read_failed();
+					if ((options & OPT_FULL_PROG) ||
+					    _fmemcmp(MK_FP(page_seg, 0), MK_FP(file_seg, 0), page_size) != 0)
+						backup_page(page_seg, page_size);
+					page_seg += page_size >> 4;
+				}
+				target->page = 0;
+				image_rewind(&target->image);
+			}
+			printf("Saved %u pages (%lu bytes) of the flash ROM content to %s.\n", backup_pages,
+			       backup_size, backup_name());
+		}
+	}
+
+	printf("Programming %u flash ROM chips with %lu bytes.\n", num_targets, total);
+	printf("Please wait. Do not reboot the system!\n");
+	progress_init(total_pages, total, chips_idle);
+	irq_scoped = chips_idle;
+	interrupts_hold();
+
+	do {
+		/* read the next page that differs from the image of each chip, before any chip is busy */
+		busy = 0;
+		for (t = 0; t < num_targets; t++) {
+			target = &targets[t];
+			eeprom_index = chips[target->chip].eeprom_index;
+			chip_seg = rom_chip_seg(chips[target->chip].rom_start, eeprom_index);
+			for (; target->page < target->num_pages; target->page++) {
+				outp(0x80, target->first_page + target->page);
+				page_seg = target->page_seg;
+				page_size = rom_page_size(eeprom_index, chip_seg, page_seg);
+				if (image_streamed(&target->image)) {
+					/* DOS and XMS or EMS drivers need interrupts to read the image */
+					interrupts_release();
+					file_seg = image_page(&target->image, page_seg, page_size, target->head,
+							      target->merge_seg);
+					interrupts_hold();
+				} else {
+					file_seg = image_page(&target->image, page_seg, page_size, target->head,
+							      target->merge_seg);
+				}
+				if (file_seg == 0)
+					rom_failure("program", page_seg, POLL_READ, 6);
+				target->page_size = page_size;
+				target->file_seg = file_seg;
+				if ((options & OPT_FULL_PROG) ||
+				    _fmemcmp(MK_FP(page_seg, 0), MK_FP(file_seg, 0), page_size) != 0) {
+					if (!(eeproms[eeprom_index].page_write && rom_blank(file_seg, page_size) &&
+					      rom_blank(page_seg, page_size)))
+						break;
+				}
+				/* page already contains the image data, no need to erase and program it */
+				video_write_char(progress_page(target->first_page + target->page), 0xB2, 0x07);
+				skipped++;
+				target->page_seg += page_size >> 4;
+				done += page_size;
+			}
+			busy |= target->page < target->num_pages;
+		}
+
+		/* start erasing the pages of all chips */
+		for (t = 0; t < num_targets; t++) {
+			target = &targets[t];
+			eeprom_index = chips[target->chip].eeprom_index;
+			target->erase = 0;
+			if (target->page == target->num_pages || !eeproms[eeprom_index].need_erase)
+				continue;
+			if (rom_blank(target->page_seg, target->page_size)) {
+				blank_skipped++;
+				continue;
+			}
+			chip_select(target->chip);
+			video_write_char(progress_page(target->first_page + target->page), 'E', 0x07);
+			target->start = bench_start();
+			rom_erase_start(chips[target->chip].rom_start, target->page_seg);
+			target->erase = 1;
+		}
+
+		/* program each page when its erase completes, the next chips keep erasing meanwhile */
+		for (t = 0; t < num_targets; t++) {
+			target = &targets[t];
+			if (target->page == target->num_pages)
+				continue;
+			chip_select(target->chip);
+			rom_start = chips[target->chip].rom_start;
+			eeprom_index = chips[target->chip].eeprom_index;
+			erase = 0;
+			if (target->erase) {
+				status = rom_erase_wait(target->page_seg, eeprom_index);
+				bench_stop(BENCH_ERASE, target->start, target->page_size);
+				/* erase the page again with the retries of rom_update_page() */
+				if (status != POLL_DONE) {
+					erase = 1;
+					retried++;
+				}
+			}
+			retried += rom_update_page(rom_start, target->page_seg, target->file_seg,
+						   target->page_size, eeprom_index, erase,
+						   progress_page(target->first_page + target->page), NULL, 0);
+			target->page_seg += target->page_size >> 4;
+			target->page++;
+			done += target->page_size;
+			progress_update(done, 0);
+		}
+	} while (busy);
+	progress_update(done, 1);
+
+	sdp_failed = rom_sdp_enable();
+	interrupts_release();
+	irq_scoped = 0;
+	for (t = 0; t < num_targets; t++)
+		if (targets[t].merge_buf != NULL)
+			hfree(targets[t].merge_buf);
+	if (sdp_seg != 0)
+		hfree(sdp_buf);
+	backup_discard();
+	if (sdp_failed != 0)
+		printf("WARNING: Failed to enable software data protection of the flash ROM.\n");
+	printf("\n%u pages programmed%s, %u unchanged pages skipped, %u blank pages not erased, %u retries.\n",
+	       total_pages - skipped, (options & OPT_VERIFY) ? " and verified" : "", skipped,
+	       blank_skipped, retried);
 	printf("Flash ROM has been programmed successfully. Please reboot the system.\n");
 }
 
@@ -565,9 +4406,14 @@ int main(int argc, char *argv[])
 {
  	int i;
 	unsigned int mode = 0;
-	__segment rom_seg = 0xF800, file_seg;
-	char *in_file = NULL, *out_file = NULL;
-	unsigned long rom_size = DEFAULT_ROM_SIZE;
+	__segment rom_seg = 0xF800;
+	struct image image;
+	struct target targets[MAX_CHIPS];
+	struct digest digest;
+	char *in_file = NULL, *out_file = NULL, *manifest = NULL, *serial = NULL, *device_file = NULL;
+	unsigned int passes = 0, num_targets = 0, t, seg;
+	int status = 0;
+	unsigned long rom_size = DEFAULT_ROM_SIZE, start;
 
 	exec_name = argv[0];
 
@@ -577,6 +4423,14 @@ int main(int argc, char *argv[])
 	if (1 == argc) usage ();
 
 	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-S")) {
+			if (++i < argc) {
+				serial = argv[i];
+			} else {
+				error("Option -S requires an argument.");
+			}
+			continue;
+		}
 		if (!strcmp(argv[i], "-i")) {
 			if (++i < argc) {
 				in_file = argv[i];
@@ -585,6 +4439,14 @@ int main(int argc, char *argv[])
 			}
 			continue;
 		}
+		if (!strcmp(argv[i], "-m")) {
+			if (++i < argc) {
+				manifest = argv[i];
+			} else {
+				error("Option -m requires an argument.");
+			}
+			continue;
+		}
 		if (!strcmp(argv[i], "-o")) {
 			if (++i < argc) {
 				out_file = argv[i];
@@ -595,9 +4457,9 @@ int main(int argc, char *argv[])
 		}
 		if (!strcmp(argv[i], "-a")) {
 			if (++i < argc) {
-				sscanf(argv[i], "%x", &rom_seg);
-				if (rom_seg < 0xC000)
+				if (sscanf(argv[i], "%x", &seg) != 1 || seg < 0xC000 || seg > 0xFFFF)
 					error("Invalid ROM segment specified (must be in C000-FFFF range).");
+				rom_seg = seg;
 			} else {
 				error("Option -a requires an argument.");
 			}
@@ -625,28 +4487,175 @@ int main(int argc, char *argv[])
 		}
 		if (!strcmp(argv[i], "-c")) {
 			mode |= MODE_CHECKSUM;
+			/* optional digest type, the additive checksum by default */
+			if (i + 1 < argc && !strcmp(argv[i + 1], "crc32")) {
+				digests |= DIGEST_CRC32;
+				i++;
+			} else if (i + 1 < argc && !strcmp(argv[i + 1], "sha1")) {
+				digests |= DIGEST_SHA1;
+				i++;
+			} else {
+				if (i + 1 < argc && !strcmp(argv[i + 1], "sum"))
+					i++;
+				digests |= DIGEST_SUM;
+			}
+			continue;
+		}
+		if (!strcmp(argv[i], "-e")) {
+			mode |= MODE_ERASE;
+			continue;
+		}
+		if (!strcmp(argv[i], "-B")) {
+			mode |= MODE_BLANK;
+			continue;
+		}
+		if (!strcmp(argv[i], "-z")) {
+			mode |= MODE_COMPRESS;
+			continue;
+		}
+		if (!strcmp(argv[i], "-H")) {
+			mode |= MODE_MAP;
+			continue;
+		}
+		if (!strcmp(argv[i], "-f")) {
+			options |= OPT_FULL_PROG;
+			continue;
+		}
+		if (!strcmp(argv[i], "-C")) {
+			options |= OPT_CHIP_ERASE;
+			continue;
+		}
+		if (!strcmp(argv[i], "-l")) {
+			options |= OPT_STREAM;
+			continue;
+		}
+		if (!strcmp(argv[i], "-b")) {
+			options |= OPT_BENCH;
+			continue;
+		}
+		if (!strcmp(argv[i], "-x")) {
+			options |= OPT_EXT;
+			continue;
+		}
+		if (!strcmp(argv[i], "-j")) {
+			if (++i < argc) {
+				journal_file = argv[i];
+			} else {
+				error("Option -j requires an argument.");
+			}
+			continue;
+		}
+		if (!strcmp(argv[i], "-k")) {
+			if (++i < argc) {
+				id_cache_file = argv[i];
+			} else {
+				error("Option -k requires an argument.");
+			}
+			continue;
+		}
+		if (!strcmp(argv[i], "-t")) {
+			if (++i < argc && sscanf(argv[i], "%x:%x", &id_cache.vendor_id,
+						 &id_cache.device_id) == 2) {
+				id_override = 1;
+			} else {
+				error("Option -t requires <vendor_id>:<device_id> argument.");
+			}
+			continue;
+		}
+		if (!strcmp(argv[i], "-T")) {
+			if (++i < argc) {
+				device_file = argv[i];
+			} else {
+				error("Option -T requires an argument.");
+			}
+			continue;
+		}
+		if (!strcmp(argv[i], "--first-diff")) {
+			max_diffs = 1;
+			continue;
+		}
+		if (!strcmp(argv[i], "--max-diffs")) {
+			if (!(++i < argc && sscanf(argv[i], "%u", &max_diffs) == 1 && max_diffs > 0))
+				error("Option --max-diffs requires a non-zero number argument.");
+			continue;
+		}
+		if (!strcmp(argv[i], "-n")) {
+			if (++i < argc) {
+				sscanf(argv[i], "%u", &retries);
+			} else {
+				error("Option -n requires an argument.");
+			}
 			continue;
 		}
 		error("Invalid command line argument.");
 	}
 	if (!mode)
-		error("Nothing to do. Please specify one of the following options: -r, -w, -v, -c.");
+		error("Nothing to do. Please specify one of the following options: -r, -p, -v, -c, -H, -e, -B, -z.");
 
 	if ((mode & MODE_READ) && NULL == out_file)
 		error("No output file specified for read mode.");
 
-	if ((mode & MODE_PROG) && NULL == in_file)
+	if ((mode & MODE_READ) && (mode & MODE_MAP))
+		error("Options -r and -H can't be used together, both write to <output_file>.");
+
+	if (serial != NULL) {
+		if (in_file != NULL || manifest != NULL)
+			error("Option -S can't be used with -i or -m.");
+		/* the image is received once, program with verify counts as a single pass */
+		passes = mode & (MODE_PROG | MODE_VERIFY | MODE_CHECKSUM | MODE_MAP | MODE_COMPRESS);
+		if (passes & MODE_PROG)
+			passes &= ~MODE_VERIFY;
+		if (passes & (passes - 1))
+			error("The image received with -S can be used by one of -p, -v, -c, -H, -z options.");
+		in_file = serial;
+	}
+
+	if ((mode & MODE_COMPRESS) && (NULL == in_file || NULL == out_file))
+		error("Compress mode requires both input and output files.");
+
+	if ((mode & MODE_COMPRESS) && (mode & (MODE_READ | MODE_MAP)))
+		error("Option -z can't be used with -r or -H, they write to <output_file>.");
+
+	if (in_file != NULL && manifest != NULL)
+		error("Options -i and -m can't be used together.");
+
+	if ((mode & MODE_PROG) && NULL == in_file && NULL == manifest)
 		error("No input file specified for program mode.");
 
-	if ((mode & MODE_VERIFY) && NULL == in_file)
+	if ((mode & MODE_VERIFY) && NULL == in_file && NULL == manifest)
 		error("No input file specified for verify mode.");
 
+	if (device_file != NULL)
+		device_file_load(device_file);
+
+	timer_init();
+	start = bench_start();
+
+	if ((options & OPT_EXT) && ext_init() == EXT_NONE)
+		printf("WARNING: No XMS or EMS memory driver found, using conventional memory.\n");
+
 	if (mode & MODE_READ)
 		rom_read(rom_seg, out_file, rom_size);
+
+	if (mode & MODE_ERASE)
+		rom_erase(rom_seg, rom_size);
+
+	if (mode & MODE_BLANK)
+		rom_blank_check(rom_seg, rom_size);
 	
-	if ((mode & MODE_PROG) || (mode & MODE_VERIFY) ||
-	    ((mode & MODE_CHECKSUM) && in_file != NULL)) {
-		file_seg = load_file(in_file, &rom_size);
+	if (manifest != NULL && ((mode & MODE_PROG) || (mode & MODE_VERIFY))) {
+		/* the regions are programmed as one image per flash ROM chip, without -i and -a */
+		num_targets = manifest_load(targets, manifest);
+		image = targets[0].image;
+		rom_seg = targets[0].seg;
+		rom_size = image.size;
+	} else if ((mode & MODE_PROG) || (mode & MODE_VERIFY) ||
+	    ((mode & (MODE_CHECKSUM | MODE_MAP | MODE_COMPRESS)) && in_file != NULL)) {
+		if (serial != NULL)
+			serial_open(&image, serial, rom_size);
+		else
+			image_open(&image, in_file, options & OPT_STREAM);
+		rom_size = image.size;
 		if (rom_seg == 0xF800) {
 			if (rom_size == 65536) {
 				rom_seg = 0xF000;	/* set default ROM segment to F0000 for 64 KiB images */
@@ -662,23 +4671,60 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (mode & MODE_COMPRESS) {
+		image_rewind(&image);
+		image_compress(&image, out_file);
+	}
+
 	if (mode & MODE_CHECKSUM) {
+		image_rewind(&image);
+		digest_init(&digest);
 		if (NULL == in_file)
-			printf("Current ROM checksum at 0x%X:0000 is 0x%X\n", rom_seg,
-			       checksum(rom_seg, rom_size));
+			digest_rom(&digest, rom_seg, rom_size);
 		else
-			printf("The checksum of %s is 0x%X\n", in_file,
-			       checksum(file_seg, rom_size));
+			digest_image(&digest, &image);
+		digest_print(&digest, rom_seg, in_file);
+	}
+
+	if (mode & MODE_MAP) {
+		image_rewind(&image);
+		rom_map(rom_seg, in_file != NULL ? &image : NULL, rom_size, out_file);
 	}
 
 	if (mode & MODE_PROG) {
-		rom_program(rom_seg, file_seg, rom_size);
+		/* verify pages as they are programmed, instead of a separate pass */
+		if (mode & MODE_VERIFY)
+			options |= OPT_VERIFY;
+		if (num_targets > 1) {
+			rom_program_chips(targets, num_targets);
+		} else {
+			image_rewind(&image);
+			rom_program(rom_seg, &image, rom_size);
+		}
 	}
 
-	if (mode & MODE_VERIFY) {
-		rom_verify(rom_seg, file_seg, rom_size);
+	if ((mode & MODE_VERIFY) && !(mode & MODE_PROG)) {
+		if (num_targets > 1) {
+			for (t = 0; t < num_targets; t++) {
+				printf("Verifying 0x%04X:0000, size %lu bytes.\n", targets[t].seg,
+				       targets[t].image.size);
+				image_rewind(&targets[t].image);
+				if (rom_verify(targets[t].seg, &targets[t].image, targets[t].image.size) != 0)
+					status = 13;
+			}
+		} else {
+			image_rewind(&image);
+			if (rom_verify(rom_seg, &image, rom_size) != 0)
+				status = 13;
+		}
 	}
 
-	return 0;
+	if (serial != NULL && passes)
+		serial_close(&image);
+
+	if (options & OPT_BENCH)
+		bench_report(start);
+
+	return status;
 }
 
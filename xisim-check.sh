@@ -0,0 +1,239 @@
+#!/bin/sh
+#
+# xisim-check.sh - regression checks of xiflash against the simulated flash ROM
+#
+# Copyright (C) 2012 - 2023 Sergey Kiselev.
+# BIOS flash ROM utility for Xi 8088 and Micro 8088 computers
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Usage: xisim-check.sh [xiflash-sim]
+# Runs "make check". Each check runs xiflash-sim with the XISIM settings and the
+# options given, and compares the exit code, the saved flash ROM content, the
+# output, and the simulator report with the expected ones. The benchmark results
+# of the checks run with -b are printed.
+
+SIM=$(cd "$(dirname "${1:-./xiflash-sim}")" && pwd)/$(basename "${1:-./xiflash-sim}")
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+# image <changed> - write a 128 KiB image: 64 KiB of pseudo-random bytes, then 64 KiB of
+# a repeated pattern. If changed is 1, one byte is changed in each of the 4 KiB pages
+# 3, 12 and 29. The default chip is an SST39SF010 with 4 KiB sectors, erasing 3 sectors
+# is faster than the chip erase
+image()
+{
+	LC_ALL=C awk -v changed="$1" 'BEGIN {
+		x = 1
+		for (i = 0; i < 131072; i++) {
+			if (i < 65536) {
+				x = (x * 75 + 74) % 65537
+				b = x % 256
+			} else {
+				b = i % 61 + 32
+			}
+			if (changed && i % 4096 == 100 && index(",3,12,29,", "," int(i / 4096) ","))
+				b = (b + 85) % 256
+			printf "%c", b
+		}
+	}'
+}
+image 0 > old.bin
+image 1 > new.bin
+
+failed=0
+checks=0
+
+# run <name> <XISIM> <exit code> <xiflash options...> - run xiflash-sim, check the exit code
+run()
+{
+	name=$1
+	settings=$2
+	expected=$3
+	shift 3
+	checks=$((checks + 1))
+	passed=1
+	rm -f saved.bin
+	XISIM="$settings save=saved.bin" "$SIM" "$@" > out.txt 2> report.txt
+	status=$?
+	if [ $status -ne "$expected" ]; then
+		fail "exit code $status, expected $expected"
+		return 1
+	fi
+	# the BIOS code doesn't run while the chip it is in is busy
+	if grep -q "timer interrupts while" report.txt; then
+		fail "$(grep "timer interrupts while" report.txt)"
+		return 1
+	fi
+	return 0
+}
+
+# fail <message> - report the failed check with the xiflash output
+fail()
+{
+	echo "FAILED: $name: $1"
+	sed 's/^/    /' out.txt report.txt
+	[ $passed -eq 1 ] && failed=$((failed + 1))
+	passed=0
+}
+
+# content <file> - check that the saved flash ROM content is the file
+content()
+{
+	if ! cmp -s saved.bin "$1"; then
+		fail "the flash ROM content differs from $1"
+	fi
+}
+
+# output <text> - check that a line of xiflash output contains the text
+output()
+{
+	if ! grep -qF -- "$1" out.txt; then
+		fail "the output doesn't contain \"$1\""
+	fi
+}
+
+# report <text> - check that a line of the simulator report contains the text
+report()
+{
+	if ! grep -qF -- "$1" report.txt; then
+		fail "the simulator report doesn't contain \"$1\""
+	fi
+}
+
+# noreport <text> - check that no line of the simulator report contains the text
+noreport()
+{
+	if grep -qF -- "$1" report.txt; then
+		fail "the simulator report contains \"$1\""
+	fi
+}
+
+run "program" "image=old.bin" 0 -p -i new.bin && content new.bin &&
+	output "3 pages programmed, 29 unchanged pages skipped" && report " 12288 byte programs, 0 page writes, 3 sector erases, 0 chip erases"
+run "program unchanged" "image=new.bin" 0 -p -i new.bin && content new.bin &&
+	output "0 pages programmed, 32 unchanged pages skipped" && report " 0 byte programs, 0 page writes, 0 sector erases"
+run "program blank" "" 0 -p -i new.bin && content new.bin &&
+	output "32 pages programmed, 0 unchanged pages skipped" && report " 0 sector erases, 1 chip erases"
+run "program and verify" "image=old.bin" 0 -p -v -i new.bin && content new.bin
+run "verify" "image=new.bin" 0 -v -i new.bin && output "No differences found"
+# the second run identifies the flash ROM with the command addresses in the cache file
+rm -f cache.txt
+run "identity cache save" "image=new.bin" 0 -p -i new.bin -k cache.txt &&
+	if [ "$(cat cache.txt)" != "$(printf 'BF B5 F000 5555 2AAA 90\r')" ]; then
+		fail "unexpected cache file content: $(cat cache.txt)"
+	fi
+run "identity cache load" "image=old.bin" 0 -p -i new.bin -k cache.txt && content new.bin &&
+	output "Detected flash ROM at 0xF000, type: SST"
+run "verify differences" "image=old.bin" 13 -v -i new.bin &&
+	output "Difference found at 0xE000:C064: ROM = 0x5C; file 0xB1" &&
+	output "3 differences found in 3 ranges" && output "Block at 0xEC00:0000, size 4096 bytes: 1 differences"
+run "verify first difference" "image=old.bin" 13 -v -i new.bin --first-diff &&
+	output "1 differences found in 1 ranges, verify stopped"
+run "checksum" "" 0 -c crc32 -i new.bin && output "The CRC-32 of new.bin is 0xD0868E64"
+
+# the sectors of an Am29F010 are 16 KiB, each changed byte is in a different one
+run "program Am29F010" "type=am29f010 image=old.bin" 0 -p -i new.bin && content new.bin &&
+	output "3 pages programmed, 5 unchanged pages skipped" && report " 49152 byte programs, 0 page writes, 3 sector erases"
+run "program retry" "image=old.bin fail_program=300" 0 -p -i new.bin && content new.bin &&
+	output "1 retries"
+run "program failure" "image=old.bin fail_program=300+" 12 -p -i new.bin &&
+	output "Failed to program flash ROM"
+run "erase failure" "type=am29f010 image=old.bin fail_erase=2+" 11 -p -i new.bin &&
+	output "Failed to erase flash ROM"
+
+# the pages saved to the journal are written back after a failure, the pages of the chip
+# that the system runs code from are saved to conventional memory instead
+run "program failure journal" "image=old.bin fail_program=300" 12 -p -n 0 -j journal.bin -i new.bin &&
+	content old.bin && output "Failed to program flash ROM at 0xE300:0000" && output "has been restored" &&
+	output "saving its content to conventional memory" && output "Saved 3 pages (12288 bytes) of the flash ROM content"
+run "program failure idle chip" "chip=C0000 size=131072 image=old.bin fail_program=300" 12 -p -n 0 -j journal.bin \
+	-a C000 -i new.bin && content old.bin && output "has been restored from the backup"
+# the journal is kept if the restore fails, each record is the 16-bit little endian segment
+# and size of the page, then its content
+rm -f journal.bin
+run "journal records" "chip=C0000 size=131072 image=old.bin fail_program=300+" 12 -p -n 0 -j journal.bin \
+	-a C000 -i new.bin && output "Failed to restore 1 of 3 saved pages"
+head -c 16384 old.bin | tail -c 4096 > page.bin
+if [ "$(od -An -tx1 -N4 journal.bin)" != " 00 c3 00 10" ] || [ "$(wc -c < journal.bin)" -ne 12300 ] ||
+   ! head -c 4100 journal.bin | tail -c 4096 | cmp -s - page.bin; then
+	fail "the journal doesn't hold the 3 saved pages, starting with page 3 of old.bin"
+fi
+run "erase failure journal" "type=am29f010 image=old.bin fail_erase=2" 11 -p -n 0 -j journal.bin -i new.bin &&
+	content old.bin && output "Failed to erase flash ROM at 0xEC00:0000" && output "has been restored"
+
+# XMODEM images are read once, the pages to program are not counted before the chip erase;
+# the sender cancels the transfer while the chip is programmed
+run "serial program" "image=old.bin serial=new.bin" 0 -p -S COM1 -s 131072 && content new.bin &&
+	output "32 pages programmed, 0 unchanged pages skipped" && report " 0 sector erases, 1 chip erases" &&
+	report "COM1: 128 blocks sent, 0 NAKs, 0 CANs"
+run "serial cancel" "image=old.bin serial=new.bin serial_cancel=60" 6 -p -S COM1 -s 131072 -j journal.bin &&
+	content old.bin && output "XMODEM transfer failed: canceled by the sender" && output "has been restored"
+# verify stops at the first difference, the rest of the transfer is canceled quietly
+run "serial first difference" "image=old.bin serial=new.bin" 13 -v -S COM1 -s 131072 --first-diff &&
+	output "1 differences found in 1 ranges, verify stopped" && report "COM1: 16 blocks sent, 0 NAKs, 1 CANs" &&
+	if grep -q "Ignored the data" out.txt; then
+		fail "the rest of the transfer is received"
+	fi
+
+# compressed images
+run "compress" "" 0 -z -i new.bin -o new.xlz && output "Compressed 131072 bytes to 82555 bytes"
+run "compressed program" "image=old.bin" 0 -p -v -i new.xlz && content new.bin
+head -c 1000 new.xlz > short.xlz
+run "compressed truncated" "image=old.bin" 6 -v -i short.xlz && content old.bin
+# the image size in the header is 2 MiB, and 512 bytes for 128 KiB of the compressed data
+{ printf 'XLZ1\000\000\040\000'; tail -c +9 new.xlz; } > big.xlz
+run "compressed size too big" "image=old.bin" 6 -v -i big.xlz &&
+	output "Compressed image big.xlz is corrupted, image size 2097152 bytes"
+{ printf 'XLZ1\000\002\000\000'; tail -c +9 new.xlz; } > small.xlz
+run "compressed size too small" "image=old.bin" 6 -v -i small.xlz &&
+	output "Compressed image small.xlz is corrupted, image size 512 bytes"
+
+# page write with software data protection, the AT29C010 pages are 128 bytes
+run "program AT29C010" "type=at29c010 image=old.bin" 0 -p -v -i new.bin && content new.bin &&
+	output "3 pages programmed and verified, 1021 unchanged pages skipped" && report " 0 byte programs, 4 page writes"
+# software data protection is disabled before the first page written, and enabled again with
+# the last page written: 6 ID mode, 6 disable, 3 pages of 128 bytes, then 3 enable and 128 writes
+run "program AT29C010 SDP" "type=at29c010 image=old.bin" 0 -p -i new.bin && content new.bin &&
+	report " 527 writes" && noreport "SDP disabled"
+run "program AT29C010 SDP failure" "type=at29c010 image=old.bin serial=new.bin serial_cancel=60" 6 -p -S COM1 \
+	-s 131072 -j journal.bin && content old.bin && output "has been restored" && noreport "SDP disabled"
+run "program AT29C010 unchanged" "type=at29c010 image=new.bin" 0 -p -i new.bin && content new.bin &&
+	report " 6 flash ROM reads, 6 writes" && noreport "SDP disabled"
+
+# the manifest regions in two AT29C010 chips are programmed together, software data protection
+# of both chips is disabled before their first page written and enabled again
+printf 'C000 new.bin\nE000 new.bin\n' > manifest.txt
+chips="chip=C0000 type=at29c010 size=131072 image=old.bin save=saved_c.bin chip=E0000 type=at29c010 size=131072"
+run "manifest SDP" "$chips image=old.bin" 0 -p -m manifest.txt && content new.bin &&
+	output "6 pages programmed, 2042 unchanged pages skipped" && report " 1054 writes" && noreport "SDP disabled" &&
+	if ! cmp -s saved_c.bin new.bin; then
+		fail "the flash ROM content at 0xC0000 differs from new.bin"
+	fi
+run "manifest SDP failure" "$chips image=old.bin fail_program=2" 12 -p -v -n 0 -j journal.bin -m manifest.txt &&
+	content old.bin && output "has been restored" && noreport "SDP disabled" &&
+	if ! cmp -s saved_c.bin old.bin; then
+		fail "the flash ROM content at 0xC0000 differs from old.bin"
+	fi
+
+# benchmark with each PIT mode, a PIT that doesn't count falls back to the call count
+for pit in "ok:PIT channel 2 count)" "gate:PIT channel 2 gate can't be enabled)" \
+	   "stuck:PIT channel 2 count doesn't change)"; do
+	run "benchmark pit=${pit%%:*}" "pit=${pit%%:*} image=old.bin" 0 -p -v -b -i new.bin &&
+		content new.bin && output "${pit#*:}" && sed -n '/^Benchmark results/,$p' out.txt
+done
+
+echo "$((checks - failed)) of $checks checks passed."
+[ $failed -eq 0 ]
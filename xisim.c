@@ -0,0 +1,1101 @@
+/*************************************************************************
+ * xisim.c - simulated flash ROM for the host build of xiflash
+ *
+ *
+ * Copyright (C) 2012 - 2023 Sergey Kiselev.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ************************************************************************/
+
+/*
+ * The model implements the JEDEC command set of the devices supported by xiflash:
+ * software ID mode, byte program, unlock bypass, sector and chip erase with DQ7, DQ6
+ * and DQ5 status, and page write with software data protection. The simulated time
+ * advances by one bus cycle for each flash ROM and I/O port access, so the delays
+ * and the polling loops of xiflash run against the PIT and the BIOS timer of the
+ * model. The CPU time between the accesses is not simulated.
+ *
+ * COM1 is connected to an XMODEM-1K sender of the serial= file, the bytes arrive
+ * at 115200 baud.
+ *
+ * The model is configured with the XISIM environment variable, a list of key=value
+ * settings, see print_help() below. The bus cycle count and the simulated time are
+ * reported to stderr at exit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xisim.h"
+
+#undef main		/* xiflash main() is xiflash_main() */
+
+#define SIM_MAX_CHIPS		4
+#define SIM_MAX_RUNS		8	/* runs of equal size sectors in the sector map */
+#define SIM_MAX_BLOCKS		64	/* memory blocks allocated with halloc() */
+#define SIM_HEAP_START		0x10000L	/* conventional memory for halloc() */
+#define SIM_HEAP_END		0xA0000L
+#define SIM_DEFAULT_CYCLE	838	/* 8088 bus cycle at 4.77 MHz, ns */
+#define PIT_HZ			1193182
+#define NS_PER_SEC		1000000000ULL
+#define NS_PER_US		1000ULL
+#define NS_PER_MS		1000000ULL
+#define SERIAL_BASE		0x3F8	/* COM1 */
+#define SERIAL_BYTE_NS		86806ULL	/* 10 bits at 115200 baud */
+#define XMODEM_BLOCK		1024
+
+/* chip state */
+#define STATE_READ		0	/* read array mode */
+#define STATE_ID		1	/* software ID mode */
+#define STATE_PROGRAM		2	/* the next write is the byte to program */
+#define STATE_LOAD		3	/* page write device is loading the page */
+#define STATE_BUSY		4	/* embedded program or erase operation is running */
+
+/* operation of the busy state */
+#define OP_PROGRAM		0
+#define OP_PAGE			1
+#define OP_SECTOR		2
+#define OP_CHIP			3
+#define OP_SDP			4	/* write cycle of a software data protection command */
+
+/* software ID mode entry commands accepted by the chip */
+#define ID_90			1	/* AA 55 90 */
+#define ID_60			(1 << 1)	/* AA 55 80 AA 55 60 */
+
+/* PIT channel 2 faults */
+#define PIT_OK			0
+#define PIT_GATE		1	/* the gate bit of port B reads back as 0, the counter stops */
+#define PIT_STUCK		2	/* the latched count never changes */
+
+struct sim_chip {
+	/* configuration */
+	unsigned long base;		/* linear address, 0 = the end of the 1 MiB address space */
+	unsigned long size;
+	unsigned char vendor_id, device_id;
+	unsigned int cmd_mask;		/* address bits decoded in the command cycles */
+	unsigned int id_cmds;		/* ID_* */
+	unsigned int page_size;		/* page write device if not 0 */
+	struct {
+		unsigned long count, size;
+	} sectors[SIM_MAX_RUNS];	/* erase sectors from the start of the chip */
+	unsigned int dq5, bypass, sdp, protect;
+	unsigned long long program_ns, write_ns, load_ns, sector_ns, chip_ns, id_ns;
+	unsigned long fail_program, fail_erase;	/* number of the operation to fail, 0 = none */
+	unsigned int fail_program_on, fail_erase_on;	/* the following operations fail too */
+	char *image, *save;
+	unsigned int fill;
+
+	/* state */
+	unsigned int state, step, bypass_mode, sdp_off, sdp_enable, replay;
+	unsigned long long id_at;	/* the IDs can be read from this time */
+	unsigned int op, failing;
+	unsigned long op_addr, op_size;
+	unsigned char op_data, toggle;
+	unsigned long long op_start, op_end;
+	unsigned char *load_buf, *load_used;
+	unsigned long load_page;
+	unsigned int load_count;
+	unsigned long long load_last;
+
+	/* statistics */
+	unsigned long programs, pages, sector_erases, chip_erases;
+	unsigned long program_ops, erase_ops;	/* for the failure injection */
+	unsigned long long busy_ns;
+};
+
+unsigned char sim_mem[SIM_MEM_SIZE];
+
+struct sim_chip sim_chips[SIM_MAX_CHIPS];
+unsigned int sim_num_chips = 0;
+
+unsigned long long sim_cycle_ns = SIM_DEFAULT_CYCLE;
+unsigned long long sim_now;		/* simulated time, ns */
+unsigned long long sim_reads, sim_writes, sim_io;	/* bus cycles */
+
+/* 8254 PIT channel 2, the 8255 PPI port B, and the BIOS timer */
+unsigned int pit_running = 0;
+unsigned long long pit_origin;		/* PIT tick count when channel 2 was programmed */
+unsigned int pit_latch, pit_high;	/* latched count, the next read returns its high byte */
+unsigned int ppi_port_b = 0;
+unsigned int pit_fault = PIT_OK;
+unsigned int sim_interrupts = 1;	/* interrupts are enabled */
+unsigned long long sim_timer_periods = 0;	/* BIOS timer interrupts delivered */
+unsigned long sim_unsafe_irqs = 0;	/* timer interrupts while a system BIOS area chip was busy */
+
+/* COM1 and the XMODEM sender at the other end */
+char *serial_file = NULL;
+unsigned char *serial_data;
+unsigned long serial_size;
+unsigned long serial_cancel = 0;	/* the sender cancels instead of sending this block, 0 = never */
+unsigned long serial_block = 1;		/* block being sent, past the end the sender sends EOT */
+unsigned int serial_lcr = 0;
+unsigned char serial_rx[XMODEM_BLOCK + 5];	/* bytes on the way to the receiver */
+unsigned int serial_rx_pos = 0, serial_rx_len = 0;
+unsigned long long serial_rx_ready;	/* time the next byte arrives */
+unsigned int serial_done = 0;		/* the transfer is over */
+unsigned long serial_blocks, serial_naks, serial_cans;	/* statistics */
+
+struct {
+	unsigned long start, end;
+	unsigned int used;
+} sim_blocks[SIM_MAX_BLOCKS];
+unsigned int sim_num_blocks = 0;
+
+/* presets of the devices in the xiflash table, typical timings */
+struct {
+	char *name;
+	unsigned char vendor_id, device_id;
+	unsigned int page_size;		/* 0 = byte program and sector erase */
+	char *sectors;
+	unsigned int dq5, bypass, sdp, id_cmds;
+	unsigned long program_us, write_us, sector_ms, chip_ms, id_us;
+} sim_types[] = {
+	{"am29f010",	0x01, 0x20, 0,   "8x16K",  1, 1, 0, ID_90, 14, 0,    1000, 8000, 10},
+	{"at29c010",	0x1F, 0xD5, 128, "1x128K", 0, 0, 1, ID_90, 0,  5000, 0,    10,   10000},
+	{"w29ee011",	0xDA, 0xC1, 128, "1x128K", 0, 0, 0, ID_60, 0,  5000, 0,    25,   10000},
+	{"sst29ee010",	0xBF, 0x07, 128, "1x128K", 0, 0, 1, ID_90, 0,  5000, 0,    10,   10},
+	{"sst39sf010",	0xBF, 0xB5, 0,   "32x4K",  0, 0, 0, ID_90, 14, 0,    18,   70,   1},
+	{NULL}
+};
+
+void print_help()
+{
+	fprintf(stderr, "XISIM settings, separated by spaces:\n");
+	fprintf(stderr, "   cycle=<ns>            - bus cycle time, the default is %u ns\n", SIM_DEFAULT_CYCLE);
+	fprintf(stderr, "   pit=ok|gate|stuck     - PIT channel 2 works, its gate can't be enabled,\n");
+	fprintf(stderr, "                           or its count doesn't change\n");
+	fprintf(stderr, "   serial=<file>         - send the file with XMODEM-1K to COM1\n");
+	fprintf(stderr, "   serial_cancel=<n>     - the sender cancels the transfer at block n\n");
+	fprintf(stderr, "   chip=<address>        - add a chip at the linear address in hexadecimal format,\n");
+	fprintf(stderr, "                           the following settings are for this chip\n");
+	fprintf(stderr, "   type=<name>           - load the preset: am29f010, at29c010, w29ee011,\n");
+	fprintf(stderr, "                           sst29ee010, sst39sf010 (the default)\n");
+	fprintf(stderr, "   id=<vendor>:<device>  - IDs in hexadecimal format\n");
+	fprintf(stderr, "   size=<bytes>          - chip size, it ends at 0xFFFFF if chip= is not set\n");
+	fprintf(stderr, "   sectors=<map>         - erase sectors, for example 1x16K,2x8K,1x32K,3x32K\n");
+	fprintf(stderr, "   page=<bytes>          - page write device with this page size, 0 = byte program\n");
+	fprintf(stderr, "   cmd=5555|555          - command addresses decoded by the chip\n");
+	fprintf(stderr, "   idcmd=90|60|any       - accepted software ID mode entry commands\n");
+	fprintf(stderr, "   program=<us> write=<us> load=<us> erase=<ms> chip_erase=<ms> id_delay=<us>\n");
+	fprintf(stderr, "                         - byte program, page write, byte load window,\n");
+	fprintf(stderr, "                           sector erase, chip erase and ID mode entry times\n");
+	fprintf(stderr, "   dq5=0|1 bypass=0|1    - DQ5 timing limit status and unlock bypass support\n");
+	fprintf(stderr, "   sdp=0|1               - the software data protection disable command is supported\n");
+	fprintf(stderr, "   protect=1             - the chip is write protected, it ignores the commands\n");
+	fprintf(stderr, "   fail_program=<n>[+]   - fail the n-th program operation [and the following]\n");
+	fprintf(stderr, "   fail_erase=<n>[+]     - fail the n-th erase operation [and the following]\n");
+	fprintf(stderr, "   image=<file>          - initial content, fill=<hex> for the rest, FF default\n");
+	fprintf(stderr, "   save=<file>           - save the content at exit\n");
+	exit(1);
+}
+
+void sim_error(char *message, char *setting)
+{
+	fprintf(stderr, "ERROR: XISIM: %s: %s\n", message, setting);
+	exit(1);
+}
+
+/* sim_type - load the settings of the device preset */
+void sim_type(struct sim_chip *chip, char *name, char *setting)
+{
+	unsigned int i;
+
+	for (i = 0; sim_types[i].name != NULL; i++)
+		if (!strcmp(sim_types[i].name, name))
+			break;
+	if (sim_types[i].name == NULL)
+		sim_error("Unknown type", setting);
+	chip->vendor_id = sim_types[i].vendor_id;
+	chip->device_id = sim_types[i].device_id;
+	chip->size = 131072;
+	chip->page_size = sim_types[i].page_size;
+	chip->dq5 = sim_types[i].dq5;
+	chip->bypass = sim_types[i].bypass;
+	chip->sdp = sim_types[i].sdp;
+	chip->id_cmds = sim_types[i].id_cmds;
+	chip->program_ns = sim_types[i].program_us * NS_PER_US;
+	chip->write_ns = sim_types[i].write_us * NS_PER_US;
+	chip->load_ns = 150 * NS_PER_US;
+	chip->sector_ns = sim_types[i].sector_ms * NS_PER_MS;
+	chip->chip_ns = sim_types[i].chip_ms * NS_PER_MS;
+	chip->id_ns = sim_types[i].id_us * NS_PER_US;
+	chip->sectors[0].count = 0;
+	if (sim_types[i].sectors != NULL) {
+		chip->sectors[0].count = atoi(sim_types[i].sectors);
+		chip->sectors[0].size = chip->size / chip->sectors[0].count;
+		chip->sectors[1].count = 0;
+	}
+}
+
+/* sim_sectors - parse the sector map */
+void sim_sectors(struct sim_chip *chip, char *map, char *setting)
+{
+	unsigned int run = 0;
+	char *end;
+
+	do {
+		if (run == SIM_MAX_RUNS)
+			sim_error("Too many sector runs", setting);
+		chip->sectors[run].count = strtoul(map, &end, 10);
+		if (*end != 'x')
+			sim_error("Invalid sector map", setting);
+		chip->sectors[run].size = strtoul(end + 1, &end, 10);
+		if (*end == 'K' || *end == 'k') {
+			chip->sectors[run].size *= 1024;
+			end++;
+		}
+		if (chip->sectors[run].count == 0 || chip->sectors[run].size == 0 ||
+		    (*end != ',' && *end != '\0'))
+			sim_error("Invalid sector map", setting);
+		run++;
+		map = end + 1;
+	} while (*end == ',');
+	if (run < SIM_MAX_RUNS)
+		chip->sectors[run].count = 0;
+}
+
+/* sim_fail - parse the number of the operation to fail, followed by + if the next ones fail too */
+void sim_fail(char *value, unsigned long *number, unsigned int *following)
+{
+	char *end;
+
+	*number = strtoul(value, &end, 10);
+	*following = (*end == '+');
+}
+
+struct sim_chip *sim_add_chip()
+{
+	struct sim_chip *chip;
+
+	if (sim_num_chips == SIM_MAX_CHIPS) {
+		fprintf(stderr, "ERROR: XISIM: Too many chips, the maximum is %u.\n", SIM_MAX_CHIPS);
+		exit(1);
+	}
+	chip = &sim_chips[sim_num_chips++];
+	memset(chip, 0, sizeof(*chip));
+	sim_type(chip, "sst39sf010", "");
+	chip->cmd_mask = 0x7FFF;
+	chip->fill = 0xFF;
+	return chip;
+}
+
+/* sim_configure - parse the XISIM environment variable */
+void sim_configure(char *config)
+{
+	char *setting, *value;
+	struct sim_chip *chip = NULL;
+	unsigned int vendor_id, device_id;
+
+	for (setting = strtok(config, " \t"); setting != NULL; setting = strtok(NULL, " \t")) {
+		if (!strcmp(setting, "help"))
+			print_help();
+		if ((value = strchr(setting, '=')) == NULL)
+			sim_error("Expected key=value", setting);
+		*value++ = '\0';
+		if (!strcmp(setting, "cycle")) {
+			sim_cycle_ns = strtoul(value, NULL, 10);
+			continue;
+		}
+		if (!strcmp(setting, "pit")) {
+			pit_fault = !strcmp(value, "gate") ? PIT_GATE : !strcmp(value, "stuck") ? PIT_STUCK : PIT_OK;
+			continue;
+		}
+		if (!strcmp(setting, "serial")) {
+			serial_file = value;
+			continue;
+		}
+		if (!strcmp(setting, "serial_cancel")) {
+			serial_cancel = strtoul(value, NULL, 10);
+			continue;
+		}
+		if (!strcmp(setting, "chip")) {
+			chip = sim_add_chip();
+			chip->base = strtoul(value, NULL, 16);
+			continue;
+		}
+		if (chip == NULL)
+			chip = sim_add_chip();
+		if (!strcmp(setting, "type")) {
+			sim_type(chip, value, setting);
+		} else if (!strcmp(setting, "id")) {
+			if (sscanf(value, "%x:%x", &vendor_id, &device_id) != 2)
+				sim_error("Invalid IDs", value);
+			chip->vendor_id = vendor_id;
+			chip->device_id = device_id;
+		} else if (!strcmp(setting, "size")) {
+			chip->size = strtoul(value, NULL, 0);
+			if (chip->sectors[1].count == 0) {
+				/* keep the uniform sector size */
+				chip->sectors[0].count = chip->size / chip->sectors[0].size;
+			}
+		} else if (!strcmp(setting, "sectors")) {
+			sim_sectors(chip, value, setting);
+		} else if (!strcmp(setting, "page")) {
+			chip->page_size = strtoul(value, NULL, 0);
+		} else if (!strcmp(setting, "cmd")) {
+			chip->cmd_mask = strcmp(value, "555") ? 0x7FFF : 0x7FF;
+		} else if (!strcmp(setting, "idcmd")) {
+			chip->id_cmds = !strcmp(value, "60") ? ID_60 : !strcmp(value, "any") ? ID_90 | ID_60 : ID_90;
+		} else if (!strcmp(setting, "program")) {
+			chip->program_ns = strtoul(value, NULL, 10) * NS_PER_US;
+		} else if (!strcmp(setting, "write")) {
+			chip->write_ns = strtoul(value, NULL, 10) * NS_PER_US;
+		} else if (!strcmp(setting, "load")) {
+			chip->load_ns = strtoul(value, NULL, 10) * NS_PER_US;
+		} else if (!strcmp(setting, "erase")) {
+			chip->sector_ns = strtoul(value, NULL, 10) * NS_PER_MS;
+		} else if (!strcmp(setting, "chip_erase")) {
+			chip->chip_ns = strtoul(value, NULL, 10) * NS_PER_MS;
+		} else if (!strcmp(setting, "id_delay")) {
+			chip->id_ns = strtoul(value, NULL, 10) * NS_PER_US;
+		} else if (!strcmp(setting, "dq5")) {
+			chip->dq5 = atoi(value);
+		} else if (!strcmp(setting, "bypass")) {
+			chip->bypass = atoi(value);
+		} else if (!strcmp(setting, "sdp")) {
+			chip->sdp = atoi(value);
+		} else if (!strcmp(setting, "protect")) {
+			chip->protect = atoi(value);
+		} else if (!strcmp(setting, "fail_program")) {
+			sim_fail(value, &chip->fail_program, &chip->fail_program_on);
+		} else if (!strcmp(setting, "fail_erase")) {
+			sim_fail(value, &chip->fail_erase, &chip->fail_erase_on);
+		} else if (!strcmp(setting, "image")) {
+			chip->image = value;
+		} else if (!strcmp(setting, "save")) {
+			chip->save = value;
+		} else if (!strcmp(setting, "fill")) {
+			chip->fill = strtoul(value, NULL, 16);
+		} else {
+			sim_error("Unknown setting", setting);
+		}
+	}
+}
+
+/* sim_init_chip - check the configuration and load the initial content of the chip */
+void sim_init_chip(struct sim_chip *chip)
+{
+	unsigned int run;
+	unsigned long total = 0;
+	FILE *fp;
+
+	if (chip->base == 0)
+		chip->base = 0x100000L - chip->size;
+	for (run = 0; run < SIM_MAX_RUNS && chip->sectors[run].count != 0; run++)
+		total += chip->sectors[run].count * chip->sectors[run].size;
+	if (chip->size == 0 || (chip->size & (chip->size - 1)) != 0 || chip->base + chip->size > 0x100000L ||
+	    (chip->page_size == 0 && total != chip->size) ||
+	    (chip->page_size != 0 && (chip->page_size & (chip->page_size - 1)) != 0)) {
+		fprintf(stderr, "ERROR: XISIM: Invalid chip at 0x%05lX, size %lu.\n", chip->base, chip->size);
+		exit(1);
+	}
+	memset(sim_mem + chip->base, chip->fill, chip->size);
+	if (chip->image != NULL) {
+		if ((fp = fopen(chip->image, "rb")) == NULL) {
+			fprintf(stderr, "ERROR: XISIM: Failed to open %s: %s.\n", chip->image, strerror(errno));
+			exit(1);
+		}
+		if (fread(sim_mem + chip->base, 1, chip->size, fp) == 0 && ferror(fp)) {
+			fprintf(stderr, "ERROR: XISIM: Failed to read %s: %s.\n", chip->image, strerror(errno));
+			exit(1);
+		}
+		fclose(fp);
+	}
+	if (chip->page_size != 0) {
+		chip->load_buf = malloc(chip->page_size);
+		chip->load_used = malloc(chip->page_size);
+		if (chip->load_buf == NULL || chip->load_used == NULL) {
+			fprintf(stderr, "ERROR: XISIM: Not enough memory.\n");
+			exit(1);
+		}
+	}
+	chip->sdp_off = 0;	/* page write devices start protected */
+}
+
+/* sim_pit_ticks - return the number of PIT ticks since the start */
+unsigned long long sim_pit_ticks()
+{
+	return sim_now / NS_PER_SEC * PIT_HZ + sim_now % NS_PER_SEC * PIT_HZ / NS_PER_SEC;
+}
+
+/*
+ * sim_bios_tick - add count to the BIOS timer tick count at 0040:006C
+ * The timer interrupt handler runs from the system BIOS, it can't be read while
+ * a chip in that area is busy.
+ */
+void sim_bios_tick(unsigned long count)
+{
+	unsigned char *ticks = sim_mem + 0x46C;
+	unsigned long value;
+	unsigned int i;
+
+	for (i = 0; i < sim_num_chips; i++)
+		if (sim_chips[i].base + sim_chips[i].size > 0xE0000 &&
+		    (sim_chips[i].state == STATE_BUSY || sim_chips[i].state == STATE_LOAD))
+			sim_unsafe_irqs++;
+
+	value = ticks[0] | ((unsigned long) ticks[1] << 8) | ((unsigned long) ticks[2] << 16) |
+		((unsigned long) ticks[3] << 24);
+	value += count;
+	ticks[0] = value;
+	ticks[1] = value >> 8;
+	ticks[2] = value >> 16;
+	ticks[3] = value >> 24;
+}
+
+/* sim_chip_update - complete the operations that are over by now */
+void sim_chip_update(struct sim_chip *chip)
+{
+	unsigned int i;
+
+	if (chip->state == STATE_LOAD && sim_now >= chip->load_last + chip->load_ns && chip->load_count == 0) {
+		/* the page write command sequence without a page load has no effect */
+		chip->state = STATE_READ;
+		chip->sdp_enable = 0;
+	} else if (chip->state == STATE_LOAD && sim_now >= chip->load_last + chip->load_ns) {
+		/* no byte is loaded within the byte load window, the write cycle starts */
+		chip->state = STATE_BUSY;
+		chip->op_start = chip->load_last + chip->load_ns;
+		/* the page write after the command sequence enables software data protection */
+		if (chip->sdp_enable)
+			chip->sdp_off = 0;
+		chip->sdp_enable = 0;
+		chip->op = OP_PAGE;
+		chip->pages++;
+		chip->program_ops++;
+		chip->failing = chip->fail_program != 0 && (chip->program_ops == chip->fail_program ||
+			(chip->fail_program_on && chip->program_ops > chip->fail_program));
+		chip->op_end = chip->op_start + chip->write_ns;
+	}
+	if (chip->state != STATE_BUSY || sim_now < chip->op_end || (chip->failing && chip->dq5))
+		return;
+
+	/* a failed operation of a device without DQ5 completes, but the data is not written */
+	if (!chip->failing) {
+		switch (chip->op) {
+		case OP_PROGRAM:
+			sim_mem[chip->base + chip->op_addr] &= chip->op_data;
+			break;
+		case OP_PAGE:
+			for (i = 0; i < chip->page_size; i++)
+				sim_mem[chip->base + chip->load_page + i] =
+					chip->load_used[i] ? chip->load_buf[i] : 0xFF;
+			break;
+		case OP_SECTOR:
+		case OP_CHIP:
+			memset(sim_mem + chip->base + chip->op_addr, 0xFF, chip->op_size);
+			break;
+		}
+	}
+	chip->busy_ns += chip->op_end - chip->op_start;
+	chip->state = STATE_READ;
+}
+
+/* sim_advance - advance the simulated time by one bus cycle */
+void sim_advance()
+{
+	unsigned long long periods;
+	unsigned int i;
+
+	sim_now += sim_cycle_ns;
+	periods = sim_pit_ticks() >> 16;
+	/* the BIOS timer interrupts are held while the interrupts are disabled */
+	if (sim_interrupts && periods != sim_timer_periods) {
+		sim_bios_tick(periods - sim_timer_periods);
+		sim_timer_periods = periods;
+	}
+	for (i = 0; i < sim_num_chips; i++)
+		sim_chip_update(&sim_chips[i]);
+}
+
+/* sim_chip_at - return the chip at the linear address, and the address in the chip */
+struct sim_chip *sim_chip_at(volatile unsigned char *address, unsigned long *chip_addr)
+{
+	unsigned long linear = (unsigned long) ((unsigned char *) address - sim_mem) & 0xFFFFF;
+	unsigned int i;
+
+	for (i = 0; i < sim_num_chips; i++) {
+		if (linear >= sim_chips[i].base && linear < sim_chips[i].base + sim_chips[i].size) {
+			*chip_addr = linear - sim_chips[i].base;
+			return &sim_chips[i];
+		}
+	}
+	*chip_addr = linear;
+	return NULL;
+}
+
+/* sim_sector - return the erase sector containing addr, and its start in *start */
+unsigned long sim_sector(struct sim_chip *chip, unsigned long addr, unsigned long *start)
+{
+	unsigned int run;
+	unsigned long offset = 0, run_size;
+
+	for (run = 0; run < SIM_MAX_RUNS && chip->sectors[run].count != 0; run++) {
+		run_size = chip->sectors[run].count * chip->sectors[run].size;
+		if (addr < offset + run_size) {
+			*start = addr - (addr - offset) % chip->sectors[run].size;
+			return chip->sectors[run].size;
+		}
+		offset += run_size;
+	}
+	*start = 0;
+	return chip->size;
+}
+
+/* sim_busy - start an embedded operation */
+void sim_busy(struct sim_chip *chip, unsigned int op, unsigned long long duration, unsigned int failing)
+{
+	chip->state = STATE_BUSY;
+	chip->op = op;
+	chip->op_start = sim_now;
+	chip->op_end = sim_now + duration;
+	chip->failing = failing;
+}
+
+/* sim_load - load a byte into the page buffer of a page write device */
+void sim_load(struct sim_chip *chip, unsigned long addr, unsigned char data)
+{
+	if (chip->state != STATE_LOAD || chip->load_count == 0) {
+		chip->state = STATE_LOAD;
+		chip->load_count = 0;
+		memset(chip->load_used, 0, chip->page_size);
+	}
+	/* the page is selected by the last byte loaded */
+	chip->load_page = addr & ~(unsigned long) (chip->page_size - 1);
+	chip->load_buf[addr & (chip->page_size - 1)] = data;
+	chip->load_used[addr & (chip->page_size - 1)] = 1;
+	chip->op_data = data;
+	chip->load_count++;
+	chip->load_last = sim_now;
+}
+
+/* sim_program - program a byte of a byte program device */
+void sim_program(struct sim_chip *chip, unsigned long addr, unsigned char data)
+{
+	chip->programs++;
+	chip->program_ops++;
+	chip->op_addr = addr;
+	chip->op_data = data;
+	sim_busy(chip, OP_PROGRAM, chip->program_ns, chip->fail_program != 0 &&
+		 (chip->program_ops == chip->fail_program ||
+		  (chip->fail_program_on && chip->program_ops > chip->fail_program)));
+}
+
+/* sim_erase - start a sector erase, or a chip erase if size is the chip size */
+void sim_erase(struct sim_chip *chip, unsigned long start, unsigned long size, unsigned long long duration)
+{
+	chip->erase_ops++;
+	chip->op_addr = start;
+	chip->op_size = size;
+	chip->op_data = 0xFF;
+	sim_busy(chip, size == chip->size ? OP_CHIP : OP_SECTOR, duration, chip->fail_erase != 0 &&
+		 (chip->erase_ops == chip->fail_erase ||
+		  (chip->fail_erase_on && chip->erase_ops > chip->fail_erase)));
+}
+
+/* sim_command - process a write cycle of the command sequence */
+void sim_command(struct sim_chip *chip, unsigned long addr, unsigned char data)
+{
+	unsigned int cmd1 = ((addr & chip->cmd_mask) == (0x5555 & chip->cmd_mask));
+	unsigned int cmd2 = ((addr & chip->cmd_mask) == (0x2AAA & chip->cmd_mask));
+	unsigned long start, size;
+
+	if (chip->state == STATE_PROGRAM) {
+		sim_program(chip, addr, data);
+		return;
+	}
+	if (chip->state == STATE_LOAD) {
+		sim_load(chip, addr, data);
+		return;
+	}
+
+	switch (chip->step) {
+	case 0:
+	case 3:
+		if (data == 0xAA && cmd1) {
+			chip->step++;
+		} else if (chip->step == 0 && chip->bypass_mode && data == 0xA0) {
+			chip->state = STATE_PROGRAM;
+		} else if (chip->step == 0 && chip->bypass_mode == 2 && data == 0x00) {
+			chip->bypass_mode = 0;		/* unlock bypass reset, 90 00 */
+		} else if (chip->step == 0 && chip->bypass_mode && data == 0x90) {
+			chip->bypass_mode = 2;
+		} else if (chip->step == 0 && chip->page_size != 0 && chip->sdp_off) {
+			sim_load(chip, addr, data);
+		} else {
+			if (data == 0xF0)
+				chip->state = STATE_READ;
+			chip->step = 0;
+		}
+		return;
+	case 1:
+	case 4:
+		if (data == 0x55 && cmd2) {
+			chip->step++;
+			return;
+		}
+		if (chip->step == 1 && chip->page_size != 0 && chip->sdp_off) {
+			/* not a command, both writes are page data */
+			sim_load(chip, chip->replay, 0xAA);
+			sim_load(chip, addr, data);
+		}
+		chip->step = 0;
+		return;
+	case 2:
+		chip->step = 0;
+		if (!cmd1)
+			return;
+		if (data == 0x90 && (chip->id_cmds & ID_90)) {
+			chip->state = STATE_ID;
+			chip->id_at = sim_now + chip->id_ns;
+		} else if (data == 0xF0) {
+			chip->state = STATE_READ;
+		} else if (data == 0xA0) {
+			if (chip->page_size != 0) {
+				/* page write, also enables software data protection when the page is loaded */
+				chip->sdp_enable = 1;
+				chip->state = STATE_LOAD;
+				chip->load_count = 0;
+				chip->load_last = sim_now;
+			} else {
+				chip->state = STATE_PROGRAM;
+			}
+		} else if (data == 0x80) {
+			chip->step = 3;
+		} else if (data == 0x20 && chip->bypass && chip->page_size == 0) {
+			chip->bypass_mode = 1;
+		}
+		return;
+	case 5:
+		chip->step = 0;
+		if (data == 0x30 && chip->page_size == 0) {
+			size = sim_sector(chip, addr, &start);
+			chip->sector_erases++;
+			sim_erase(chip, start, size, chip->sector_ns);
+		} else if (data == 0x10 && cmd1) {
+			chip->chip_erases++;
+			sim_erase(chip, 0, chip->size, chip->chip_ns);
+		} else if (data == 0x60 && cmd1 && (chip->id_cmds & ID_60)) {
+			chip->state = STATE_ID;
+			chip->id_at = sim_now + chip->id_ns;
+		} else if (data == 0x20 && cmd1 && chip->page_size != 0 && chip->sdp) {
+			/* software data protection disable */
+			chip->sdp_off = 1;
+			chip->op_data = 0xFF;
+			sim_busy(chip, OP_SDP, chip->write_ns, 0);
+		}
+		return;
+	}
+}
+
+void sim_flash_write(volatile unsigned char *address, unsigned char data)
+{
+	struct sim_chip *chip;
+	unsigned long addr;
+
+	sim_writes++;
+	sim_advance();
+	if ((chip = sim_chip_at(address, &addr)) == NULL || chip->protect)
+		return;
+	if (chip->state == STATE_BUSY) {
+		/* the reset command returns the device to read mode after a DQ5 failure */
+		if (chip->failing && chip->dq5 && data == 0xF0) {
+			chip->busy_ns += sim_now - chip->op_start;
+			chip->state = STATE_READ;
+		}
+		return;
+	}
+	if (chip->step == 0)
+		chip->replay = addr;
+	sim_command(chip, addr, data);
+}
+
+unsigned char sim_flash_read(volatile unsigned char *address)
+{
+	struct sim_chip *chip;
+	unsigned long addr;
+	unsigned char status;
+
+	sim_reads++;
+	sim_advance();
+	if ((chip = sim_chip_at(address, &addr)) == NULL)
+		return *address;
+	if (chip->state == STATE_LOAD) {
+		/* a read ends the page load, the write cycle starts */
+		chip->load_last = sim_now - chip->load_ns;
+		sim_chip_update(chip);
+	}
+	switch (chip->state) {
+	case STATE_ID:
+		if (sim_now >= chip->id_at)
+			return (addr & 1) ? chip->device_id : chip->vendor_id;
+		break;
+	case STATE_BUSY:
+		/* DQ7 is the complement of the data, DQ6 toggles, DQ5 is set after the time limit */
+		chip->toggle ^= 0x40;
+		status = (~chip->op_data & 0x80) | chip->toggle;
+		if (chip->failing && chip->dq5 && sim_now >= chip->op_end)
+			status |= 0x20;
+		return status;
+	}
+	return *address;
+}
+
+/* serial_init - load the file sent to COM1 and add COM1 to the BIOS data area */
+void serial_init()
+{
+	FILE *fp;
+
+	if (serial_file == NULL)
+		return;
+	if ((fp = fopen(serial_file, "rb")) == NULL || fseek(fp, 0, SEEK_END) != 0) {
+		fprintf(stderr, "ERROR: XISIM: Failed to open %s: %s.\n", serial_file, strerror(errno));
+		exit(1);
+	}
+	serial_size = ftell(fp);
+	rewind(fp);
+	if ((serial_data = malloc(serial_size + 1)) == NULL ||
+	    fread(serial_data, 1, serial_size, fp) != serial_size) {
+		fprintf(stderr, "ERROR: XISIM: Failed to read %s: %s.\n", serial_file, strerror(errno));
+		exit(1);
+	}
+	fclose(fp);
+	sim_mem[0x400] = SERIAL_BASE & 0xFF;
+	sim_mem[0x401] = SERIAL_BASE >> 8;
+}
+
+/* serial_send - queue the current block, EOT past the end of the file, or CAN */
+void serial_send()
+{
+	unsigned long pos = (serial_block - 1) * XMODEM_BLOCK, count;
+	unsigned int i, crc = 0, bit;
+
+	serial_rx_pos = 0;
+	serial_rx_ready = sim_now + SERIAL_BYTE_NS;
+	if (serial_block == serial_cancel) {
+		serial_rx[0] = 0x18;
+		serial_rx[1] = 0x18;
+		serial_rx_len = 2;
+		serial_done = 1;
+		return;
+	}
+	if (pos >= serial_size) {
+		serial_rx[0] = 0x04;
+		serial_rx_len = 1;
+		return;
+	}
+	count = serial_size - pos < XMODEM_BLOCK ? serial_size - pos : XMODEM_BLOCK;
+	serial_rx[0] = 0x02;
+	serial_rx[1] = serial_block;
+	serial_rx[2] = ~serial_block;
+	memcpy(serial_rx + 3, serial_data + pos, count);
+	memset(serial_rx + 3 + count, 0x1A, XMODEM_BLOCK - count);
+	for (i = 0; i < XMODEM_BLOCK; i++) {
+		crc ^= serial_rx[3 + i] << 8;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) & 0xFFFF : (crc << 1) & 0xFFFF;
+	}
+	serial_rx[3 + XMODEM_BLOCK] = crc >> 8;
+	serial_rx[4 + XMODEM_BLOCK] = crc & 0xFF;
+	serial_rx_len = XMODEM_BLOCK + 5;
+	serial_blocks++;
+}
+
+/* serial_receive - the sender gets a byte from the receiver */
+void serial_receive(unsigned int ch)
+{
+	if (serial_done)
+		return;
+	switch (ch) {
+	case 0x06:	/* ACK */
+		if ((serial_block - 1) * XMODEM_BLOCK >= serial_size) {
+			serial_done = 1;
+			return;
+		}
+		serial_block++;
+		serial_send();
+		break;
+	case 0x15:	/* NAK */
+		serial_naks++;
+		serial_send();
+		break;
+	case 'C':
+		if (serial_block == 1)
+			serial_send();
+		break;
+	case 0x18:	/* CAN */
+		serial_cans++;
+		serial_done = 1;
+		serial_rx_len = 0;
+		break;
+	}
+}
+
+/* inp, outp - 8254 PIT channel 2, the 8255 PPI port B, and COM1, the other ports are ignored */
+unsigned int inp(unsigned int port)
+{
+	unsigned int value = 0xFF;
+
+	sim_io++;
+	sim_advance();
+	switch (port) {
+	case 0x42:
+		value = pit_high ? pit_latch >> 8 : pit_latch & 0xFF;
+		pit_high = !pit_high;
+		break;
+	case 0x61:
+		value = ppi_port_b;
+		break;
+	case SERIAL_BASE:
+		value = 0;
+		if (serial_rx_pos < serial_rx_len && sim_now >= serial_rx_ready) {
+			value = serial_rx[serial_rx_pos++];
+			serial_rx_ready = sim_now + SERIAL_BYTE_NS;
+		}
+		break;
+	case SERIAL_BASE + 5:	/* LSR, the transmitter is always ready */
+		value = 0x60;
+		if (serial_rx_pos < serial_rx_len && sim_now >= serial_rx_ready)
+			value |= 0x01;
+		break;
+	}
+	return value;
+}
+
+unsigned int outp(unsigned int port, unsigned int value)
+{
+	sim_io++;
+	sim_advance();
+	switch (port) {
+	case 0x43:
+		if ((value & 0xF0) == 0x80) {
+			/* latch the count, mode 2 counts down from 65536 */
+			if (pit_running && (ppi_port_b & 0x01) && pit_fault != PIT_STUCK)
+				pit_latch = (0x10000 - ((sim_pit_ticks() - pit_origin) & 0xFFFF)) & 0xFFFF;
+			pit_high = 0;
+		} else if ((value & 0xC0) == 0x80) {
+			pit_running = 1;
+			pit_origin = sim_pit_ticks();
+			pit_high = 0;
+		}
+		break;
+	case 0x61:
+		ppi_port_b = (pit_fault == PIT_GATE) ? value & ~0x01 : value;
+		break;
+	case SERIAL_BASE:
+		if (!(serial_lcr & 0x80) && serial_file != NULL)
+			serial_receive(value);
+		break;
+	case SERIAL_BASE + 3:
+		serial_lcr = value;
+		break;
+	}
+	return value;
+}
+
+void _disable()
+{
+	sim_interrupts = 0;
+}
+
+/* _enable - deliver the BIOS timer interrupt pending while the interrupts were disabled */
+void _enable()
+{
+	unsigned long long periods = sim_pit_ticks() >> 16;
+
+	sim_interrupts = 1;
+	if (periods != sim_timer_periods) {
+		sim_bios_tick(1);
+		sim_timer_periods = periods;
+	}
+}
+
+/* int86 - 80x25 text mode video, no XMS or EMS driver */
+int int86(int intno, union REGS *in, union REGS *out)
+{
+	union REGS r = *in;
+
+	switch (intno) {
+	case 0x10:
+		if (r.h.ah == 0x0F) {
+			r.h.al = 0x03;
+			r.h.ah = 80;
+			r.h.bh = 0;
+		} else if (r.h.ah == 0x03) {
+			r.h.dh = 24;
+			r.h.dl = 0;
+		}
+		break;
+	case 0x2F:
+		if (r.x.ax == 0x4300)
+			r.h.al = 0;
+		break;
+	case 0x67:
+		r.h.ah = 0x84;		/* function not supported */
+		break;
+	}
+	r.x.cflag = 0;
+	*out = r;
+	return r.x.ax;
+}
+
+int int86x(int intno, union REGS *in, union REGS *out, struct SREGS *s)
+{
+	(void) s;
+	return int86(intno, in, out);
+}
+
+void segread(struct SREGS *s)
+{
+	memset(s, 0, sizeof(*s));
+}
+
+unsigned int _dos_open(const char *name, unsigned int mode, int *handle)
+{
+	if ((*handle = open(name, mode)) == -1)
+		return errno;
+	return 0;
+}
+
+unsigned int _dos_creat(const char *name, unsigned int attr, int *handle)
+{
+	(void) attr;
+	if ((*handle = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1)
+		return errno;
+	return 0;
+}
+
+unsigned int _dos_close(int handle)
+{
+	return close(handle) == -1 ? errno : 0;
+}
+
+unsigned int _dos_read(int handle, void *buf, unsigned int count, unsigned int *bytes)
+{
+	ssize_t result;
+
+	if ((result = read(handle, buf, count)) == -1)
+		return errno;
+	*bytes = result;
+	return 0;
+}
+
+unsigned int _dos_write(int handle, const void *buf, unsigned int count, unsigned int *bytes)
+{
+	ssize_t result;
+
+	if ((result = write(handle, buf, count)) == -1)
+		return errno;
+	*bytes = result;
+	return 0;
+}
+
+/* halloc - allocate conventional memory, the blocks are freed in any order */
+void *halloc(long count, size_t size)
+{
+	unsigned long start = SIM_HEAP_START, bytes = (count * size + 15) & ~15UL;
+
+	/* drop the freed blocks at the top */
+	while (sim_num_blocks > 0 && !sim_blocks[sim_num_blocks - 1].used)
+		sim_num_blocks--;
+	if (sim_num_blocks > 0)
+		start = sim_blocks[sim_num_blocks - 1].end;
+	if (sim_num_blocks == SIM_MAX_BLOCKS || start + bytes > SIM_HEAP_END)
+		return NULL;
+	sim_blocks[sim_num_blocks].start = start;
+	sim_blocks[sim_num_blocks].end = start + bytes;
+	sim_blocks[sim_num_blocks].used = 1;
+	sim_num_blocks++;
+	return sim_mem + start;
+}
+
+void hfree(void *buf)
+{
+	unsigned int i;
+
+	for (i = 0; i < sim_num_blocks; i++)
+		if (sim_mem + sim_blocks[i].start == buf)
+			sim_blocks[i].used = 0;
+}
+
+/* sim_ms - print the time in ms */
+void sim_ms(unsigned long long ns)
+{
+	fprintf(stderr, "%llu.%03llu ms", ns / NS_PER_MS, ns / NS_PER_US % 1000);
+}
+
+/* sim_exit - save the flash ROM content and report the statistics */
+void sim_exit()
+{
+	struct sim_chip *chip;
+	unsigned int i;
+	unsigned long long now = sim_now;
+	FILE *fp;
+
+	for (i = 0; i < sim_num_chips; i++) {
+		chip = &sim_chips[i];
+		/* let the last operation complete */
+		sim_now = ~0ULL >> 1;
+		sim_chip_update(chip);
+		sim_chip_update(chip);
+		sim_now = now;
+		if (chip->save != NULL) {
+			if ((fp = fopen(chip->save, "wb")) == NULL ||
+			    fwrite(sim_mem + chip->base, 1, chip->size, fp) != chip->size) {
+				fprintf(stderr, "ERROR: XISIM: Failed to write %s: %s.\n", chip->save,
+					strerror(errno));
+			}
+			if (fp != NULL)
+				fclose(fp);
+		}
+	}
+
+	fprintf(stderr, "Simulator: %llu bus cycles, %llu flash ROM reads, %llu writes, %llu I/O, ",
+		sim_reads + sim_writes + sim_io, sim_reads, sim_writes, sim_io);
+	sim_ms(sim_now);
+	fprintf(stderr, "\n");
+	for (i = 0; i < sim_num_chips; i++) {
+		chip = &sim_chips[i];
+		fprintf(stderr, "Simulator: chip %u at 0x%05lX: %lu byte programs, %lu page writes, "
+			"%lu sector erases, %lu chip erases, busy ", i, chip->base, chip->programs,
+			chip->pages, chip->sector_erases, chip->chip_erases);
+		sim_ms(chip->busy_ns);
+		fprintf(stderr, chip->page_size != 0 && chip->sdp && chip->sdp_off ? ", SDP disabled\n" : "\n");
+	}
+	if (sim_unsafe_irqs != 0)
+		fprintf(stderr, "Simulator: %lu timer interrupts while a system BIOS area chip was busy\n",
+			sim_unsafe_irqs);
+	if (serial_file != NULL)
+		fprintf(stderr, "Simulator: COM1: %lu blocks sent, %lu NAKs, %lu CANs received\n",
+			serial_blocks, serial_naks, serial_cans);
+}
+
+int main(int argc, char *argv[])
+{
+	char *config = getenv("XISIM");
+	unsigned int i;
+
+	if (config != NULL && (config = strdup(config)) != NULL)
+		sim_configure(config);
+	if (sim_num_chips == 0)
+		sim_add_chip();
+	for (i = 0; i < sim_num_chips; i++)
+		sim_init_chip(&sim_chips[i]);
+	serial_init();
+	atexit(sim_exit);
+	/* stdout is flushed before the report */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	return xiflash_main(argc, argv);
+}
@@ -0,0 +1,101 @@
+/*************************************************************************
+ * xisim.h - host build of xiflash against a simulated flash ROM
+ *
+ *
+ * Copyright (C) 2012 - 2023 Sergey Kiselev.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ************************************************************************/
+
+/*
+ * Replaces the Open Watcom DOS headers when xiflash.c is built with -DXIFLASH_SIM.
+ * Far pointers point into sim_mem, the simulated 1 MiB real mode address space.
+ * The flash ROM bus cycles, the I/O ports, and the BIOS services used by xiflash
+ * are implemented by the flash ROM model in xisim.c.
+ */
+
+#ifndef XISIM_H
+#define XISIM_H
+
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* Open Watcom keywords */
+#define __far
+#define __huge
+#define __segment		unsigned short
+
+/* real mode address space, FFFF:FFFF is 64 KiB above 1 MiB */
+#define SIM_MEM_SIZE		0x110000L
+extern unsigned char sim_mem[SIM_MEM_SIZE];
+
+#define MK_FP(seg, off)		((void *) (sim_mem + ((unsigned long) (unsigned short) (seg) << 4) + \
+				 (unsigned short) (off)))
+#define FP_SEG(p)		((unsigned short) (((unsigned char *) (p) - sim_mem) >> 4))
+#define FP_OFF(p)		((unsigned short) (((unsigned char *) (p) - sim_mem) & 0x0F))
+
+/* flash ROM bus cycles */
+#define flash_read(address)		sim_flash_read(address)
+#define flash_write(address, data)	sim_flash_write(address, data)
+unsigned char sim_flash_read(volatile unsigned char *address);
+void sim_flash_write(volatile unsigned char *address, unsigned char data);
+
+/* I/O ports and interrupts */
+unsigned int inp(unsigned int port);
+unsigned int outp(unsigned int port, unsigned int value);
+void _disable(void);
+void _enable(void);
+
+/* BIOS interrupts */
+struct WORDREGS {
+	unsigned short ax, bx, cx, dx, si, di, cflag;
+};
+struct BYTEREGS {
+	unsigned char al, ah, bl, bh, cl, ch, dl, dh;
+};
+union REGS {
+	struct WORDREGS x;
+	struct BYTEREGS h;
+};
+struct SREGS {
+	unsigned short es, cs, ss, ds;
+};
+int int86(int intno, union REGS *in, union REGS *out);
+int int86x(int intno, union REGS *in, union REGS *out, struct SREGS *s);
+void segread(struct SREGS *s);
+
+/* DOS file functions, return 0 or the error code */
+#define _A_NORMAL		0
+unsigned int _dos_open(const char *name, unsigned int mode, int *handle);
+unsigned int _dos_creat(const char *name, unsigned int attr, int *handle);
+unsigned int _dos_close(int handle);
+unsigned int _dos_read(int handle, void *buf, unsigned int count, unsigned int *bytes);
+unsigned int _dos_write(int handle, const void *buf, unsigned int count, unsigned int *bytes);
+
+/* conventional memory, allocated in sim_mem */
+void *halloc(long count, size_t size);
+void hfree(void *buf);
+
+#define _fmemcpy		memcpy
+#define _fmemcmp		memcmp
+#define _fmemset		memset
+
+/* xisim.c sets up the model before running xiflash */
+#define main			xiflash_main
+int xiflash_main(int argc, char *argv[]);
+
+#endif